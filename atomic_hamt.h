@@ -0,0 +1,119 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+#pragma once
+
+
+#include "hamt.h"
+#include <atomic>
+#include <thread>
+
+
+// A shared, mutable reference to an evolving hamt, for many reader and writer threads
+// Versions are immutable, so readers just load() the current one and use it without locks.
+// Writers derive a new version from the current one and publish it with compare-and-swap,
+// retrying (with exponential backoff) if another writer published first. An update's
+// function may therefore run more than once and should have no side effects beyond
+// building its result. Use the default gc_alloc policy: the arena and pool policies are
+// per thread, while versions published here are shared by all threads.
+template <typename K, typename V, typename A = gc_alloc, typename G = hamt_geometry>
+class atomic_hamt
+{
+    typedef hamt<K,V,A,G> hamt_t;
+
+    std::atomic<const hamt_t*> root;
+
+    // Waits a little longer after each failed compare-and-swap, then yields once spins run long
+    static void backoff(u32* const spins)
+    {
+        for (u32 i = 0; i < *spins; ++i)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        if (*spins < 1024)
+            *spins *= 2;
+        else
+            std::this_thread::yield();
+    }
+
+public:
+    atomic_hamt()
+        : root(new ((hamt_t*)A::allocate(sizeof(hamt_t))) hamt_t())
+    { }
+
+    explicit atomic_hamt(const hamt_t* const h)
+        : root(h)
+    { }
+
+    // The current version; it stays valid (and unchanged) however the map evolves after
+    const hamt_t* load() const
+    {
+        return root.load(std::memory_order_acquire);
+    }
+
+    // Replaces the current version outright
+    void store(const hamt_t* const h)
+    {
+        root.store(h, std::memory_order_release);
+    }
+
+    const V* get(const K* const key) const
+    {
+        return load()->get(key);
+    }
+
+    const V* get(const K& key) const
+    {
+        return load()->get(key);
+    }
+
+    u64 size() const
+    {
+        return load()->size();
+    }
+
+    // Atomically replaces the current version h with fn(h) and returns the version published
+    // fn is retried against the newer version whenever another writer gets in first; if it
+    // returns h unchanged nothing is published.
+    template <typename F>
+    const hamt_t* update(F fn)
+    {
+        const hamt_t* cur = load();
+        u32 spins = 1;
+        while (true)
+        {
+            const hamt_t* const next = fn(cur);
+            if (next == cur)
+                return cur;
+            if (root.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_acquire))
+                return next;
+            // cur now holds the version that beat us
+            backoff(&spins);
+        }
+    }
+
+    const hamt_t* insert(const K* const key, const V* const val)
+    {
+        return update([=](const hamt_t* const h) { return h->insert(key, val); });
+    }
+
+    const hamt_t* insert_if_absent(const K* const key, const V* const val)
+    {
+        return update([=](const hamt_t* const h) { return h->insert_if_absent(key, val); });
+    }
+
+    // Atomically maps key to f(v), as hamt::update does; writes that change nothing publish nothing
+    template <typename F>
+    const hamt_t* update(const K* const key, F f)
+    {
+        return update([=](const hamt_t* const h) { return h->update(key, f); });
+    }
+
+    const hamt_t* remove(const K* const key)
+    {
+        return update([=](const hamt_t* const h) { return h->remove(key); });
+    }
+};
@@ -0,0 +1,346 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+// Benchmarks hamt against std::unordered_map and a copy-on-write std::map
+// Each workload (insert, hit and miss gets, remove, full iteration, and retaining every
+// version) runs over a range of sizes and key distributions, and reports ns/op, bytes
+// allocated/op and milliseconds spent in full collections. Usage:
+//   ./bench_hamt [max size, default 1000000]
+// Sizes go up by 10x from 1000 to the max (1e8 needs a machine with plenty of memory).
+
+
+#include "gc.h"
+#include "hamt.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+
+// Counts bytes requested through operator new, for the std:: baselines
+static std::atomic<u64> new_bytes(0);
+
+void* operator new(std::size_t n)
+{
+    new_bytes += n;
+    void* const p = std::malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+
+u64 ntime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// The same 24-byte key as test_hamt
+class tuple
+{
+public:
+    u64 x;
+    u64 y;
+    u64 z;
+
+    tuple(u64 x, u64 y, u64 z)
+        : x(x), y(y), z(z)
+    {}
+
+    u64 hash() const
+    {
+        const u8* data = reinterpret_cast<const u8*>(this);
+        u64 h = 0xcbf29ce484222325;
+        for (u32 i = 0; i < sizeof(tuple); ++i && ++data)
+        {
+            h = h ^ *data;
+            h = h * 0x100000001b3;
+        }
+
+        return h;
+    }
+
+    bool operator==(const tuple& t) const
+    {
+        return t.x == this->x
+            && t.y == this->y
+            && t.z == this->z;
+    }
+
+    bool operator<(const tuple& t) const
+    {
+        return x < t.x || (x == t.x && (y < t.y || (y == t.y && z < t.z)));
+    }
+};
+
+// An adversarial key whose hash keeps only 6 bits, so keys pile up in collision nodes
+class weaktuple : public tuple
+{
+public:
+    weaktuple(u64 x, u64 y, u64 z)
+        : tuple(x, y, z)
+    {}
+
+    u64 hash() const
+    {
+        return tuple::hash() & 0x7000003000000001;
+    }
+};
+
+template <typename T>
+struct hash_of
+{
+    std::size_t operator()(const T& t) const
+    {
+        return t.hash();
+    }
+};
+
+
+enum dist { sequential_keys, random_keys, colliding_keys };
+const char* const dist_names[] = { "sequential", "random", "colliding" };
+
+
+// Measures one workload of ops operations and prints a row of the results table
+class meter
+{
+    u64 start;
+    u64 bytes;
+    unsigned long gcms;
+
+    static u64 allocated()
+    {
+        return GC_get_total_bytes() + new_bytes.load();
+    }
+
+public:
+    meter()
+        : start(ntime()), bytes(allocated()), gcms(GC_get_full_gc_total_time())
+    { }
+
+    void report(const char* const structure, const dist d, const u64 n, const char* const op, const u64 ops)
+    {
+        const u64 ns = ntime() - start;
+        const u64 b = allocated() - bytes;
+        const unsigned long g = GC_get_full_gc_total_time() - gcms;
+        std::printf("%-14s %-11s %10llu  %-8s %10.1f %10.1f %8lu\n", structure, dist_names[d], (unsigned long long)n,
+                    op, (double)ns / ops, (double)b / ops, g);
+    }
+};
+
+
+// Keys are allocated with GC_MALLOC so maps hold the only references to them
+template <typename T>
+const T** make_keys(const dist d, const u64 n, const u64 seed)
+{
+    std::mt19937_64 rng(seed);
+    const T** const keys = (const T**)GC_MALLOC(n*sizeof(const T*));
+    for (u64 i = 0; i < n; ++i)
+    {
+        const u64 x = d == random_keys ? rng() : seed*n + i;
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(x, x+1, x*x);
+    }
+    return keys;
+}
+
+
+template <typename T>
+void bench_hamt(const dist d, const u64 n)
+{
+    typedef hamt<T,T> map_t;
+    const T** const keys = make_keys<T>(d, n, 1);
+    const T** const misses = make_keys<T>(d, n, 2);
+    const map_t* const empty = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    volatile u64 sink = 0;
+
+    const map_t* h = empty;
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            h = h->insert(keys[i], keys[i]);
+        m.report("hamt", d, n, "insert", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h->get(keys[i]) != 0;
+        m.report("hamt", d, n, "get-hit", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h->get(misses[i]) != 0;
+        m.report("hamt", d, n, "get-miss", n);
+    }
+    {
+        meter m;
+        u64 s = 0;
+        h->for_each([&s](const T* k, const T* v) { s += k->x; });
+        sink += s;
+        m.report("hamt", d, n, "iterate", n);
+    }
+    {
+        meter m;
+        const map_t* r = h;
+        for (u64 i = 0; i < n; ++i)
+            r = r->remove(keys[i]);
+        sink += r->size();
+        m.report("hamt", d, n, "remove", n);
+    }
+    {
+        // Every intermediate version stays reachable; bytes/op is then the heap each version keeps
+        GC_gcollect();
+        const u64 heap = GC_get_heap_size() - GC_get_free_bytes();
+        const map_t** const versions = (const map_t**)GC_MALLOC(n*sizeof(const map_t*));
+        meter m;
+        const map_t* v = empty;
+        for (u64 i = 0; i < n; ++i)
+            versions[i] = v = v->insert(keys[i], keys[i]);
+        m.report("hamt", d, n, "retain", n);
+        GC_gcollect();
+        const u64 kept = GC_get_heap_size() - GC_get_free_bytes() - heap;
+        std::printf("%-14s %-11s %10llu  %-8s %21.1f\n", "hamt", dist_names[d], (unsigned long long)n, "kept", (double)kept / n);
+        sink += versions[n-1]->size();
+    }
+}
+
+template <typename T>
+void bench_unordered(const dist d, const u64 n)
+{
+    typedef std::unordered_map<T, const T*, hash_of<T> > map_t;
+    const T** const keys = make_keys<T>(d, n, 1);
+    const T** const misses = make_keys<T>(d, n, 2);
+    volatile u64 sink = 0;
+
+    map_t h;
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            h[*keys[i]] = keys[i];
+        m.report("unordered_map", d, n, "insert", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h.count(*keys[i]);
+        m.report("unordered_map", d, n, "get-hit", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h.count(*misses[i]);
+        m.report("unordered_map", d, n, "get-miss", n);
+    }
+    {
+        meter m;
+        u64 s = 0;
+        for (const auto& kv : h)
+            s += kv.first.x;
+        sink += s;
+        m.report("unordered_map", d, n, "iterate", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            h.erase(*keys[i]);
+        sink += h.size();
+        m.report("unordered_map", d, n, "remove", n);
+    }
+}
+
+// A persistent map by copying a std::map on every update; each update costs O(n), so
+// only a bounded sample of updates is timed, against a map that already holds n keys
+template <typename T>
+void bench_cow(const dist d, const u64 n)
+{
+    typedef std::map<T, const T*> map_t;
+    const T** const keys = make_keys<T>(d, n, 1);
+    const T** const misses = make_keys<T>(d, n, 2);
+    const u64 sample = std::min(n, (u64)200);
+    volatile u64 sink = 0;
+
+    map_t h;
+    for (u64 i = 0; i < n; ++i)
+        h[*keys[i]] = keys[i];
+    {
+        meter m;
+        for (u64 i = 0; i < sample; ++i)
+        {
+            map_t next(h);
+            next[*misses[i]] = misses[i];
+            sink += next.size();
+        }
+        m.report("cow std::map", d, n, "insert", sample);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h.count(*keys[i]);
+        m.report("cow std::map", d, n, "get-hit", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < n; ++i)
+            sink += h.count(*misses[i]);
+        m.report("cow std::map", d, n, "get-miss", n);
+    }
+    {
+        meter m;
+        u64 s = 0;
+        for (const auto& kv : h)
+            s += kv.first.x;
+        sink += s;
+        m.report("cow std::map", d, n, "iterate", n);
+    }
+    {
+        meter m;
+        for (u64 i = 0; i < sample; ++i)
+        {
+            map_t next(h);
+            next.erase(*keys[i]);
+            sink += next.size();
+        }
+        m.report("cow std::map", d, n, "remove", sample);
+    }
+}
+
+
+template <typename T>
+void bench_all(const dist d, const u64 n)
+{
+    bench_hamt<T>(d, n);
+    bench_unordered<T>(d, n);
+    bench_cow<T>(d, n);
+}
+
+
+int main(int argc, char** argv)
+{
+    GC_INIT();
+    GC_start_performance_measurement();
+    const u64 max = argc > 1 ? std::strtoull(argv[1], 0, 10) : 1000000;
+
+    std::printf("%-14s %-11s %10s  %-8s %10s %10s %8s\n", "structure", "keys", "n", "op", "ns/op", "bytes/op", "gc ms");
+    for (u64 n = 1000; n <= max; n *= 10)
+    {
+        bench_all<tuple>(sequential_keys, n);
+        bench_all<tuple>(random_keys, n);
+        // Colliding keys make every structure scan long chains, so they stop at 1e5
+        if (n <= 100000)
+            bench_all<weaktuple>(colliding_keys, n);
+    }
+
+    return 0;
+}
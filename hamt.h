@@ -8,656 +8,3967 @@
 #include "compat.h"
 #include "gc.h"
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
-// The largest that bottom depth can be is 10, after this you run out of 64bit hash
+// The default geometry's bottom depth (and inline_hamt's); 10 is the largest it can be,
+// after this you run out of 64bit hash
 #define bd 10
-// The fixed number of key/value slots in a root node
+// The default geometry's fixed number of key/value slots in a root node
 #define rootsize 7
 
 
-// A linked list for storing collisions after d=10 layers of inner nodes KV -> KV*
-template <typename K, typename V>
-class LL
+// Trie geometry policies
+// A geometry is a type giving the number of root slots, how a hash picks one (root_piece) and
+// how many low hash bits that consumes (root_bits); then how many bits each inner level
+// consumes (bits) and how they pick one of at most width rows (piece); and the bottom depth,
+// whose rows hold collision nodes. Bitmaps share their word with a tag bit, so width is at most 63.
+// fingerprints says whether each key/value row also caches its key's full hash (see hamt_fingerprints),
+// and content_hashes whether each root keeps a hash of its contents (see hamt_content_hashes).
+
+// The original geometry: 7 root slots, then 63-way inner nodes for 10 levels
+struct hamt_geometry
 {
-    typedef LL<K,V> LLtype;
-    
-public:
-    const K* const k;
-    const V* const v;
-    const LLtype* const next;
+    static const u32 root_slots = rootsize;
+    static const u32 root_bits = 4;
+    static const u32 bits = 6;
+    static const u32 width = 63;
+    static const u32 bottom = bd;
+    static const bool fingerprints = false;
+    static const bool content_hashes = false;
 
-    LL<K,V>(const K* k, const V* v, const LLtype* next)
-        : k(k), v(v), next(next)
-    { }
+    static u32 root_piece(const u64 h)
+    {
+        return (h & 0x11000000000000f) % rootsize;
+    }
 
-    const V* find(const K* const k) const
+    static u32 piece(const u64 h)
     {
-        if (*(this->k) == *k)
-            return v;
-        else if (next)
-            return next->find(k);
-        else
-            return 0;
+        return (h & 0x3f) % 63;
     }
+};
+
+// 2^rb root slots and 2^b-way inner nodes, for as many levels as the hash has bits
+// Pieces are plain bit fields, so no hash bits are wasted and no modulo is computed per level.
+template <u32 b, u32 rb = b>
+struct hamt_pow2_geometry
+{
+    static_assert(b >= 1 && b <= 5, "inner nodes are at most 32-way");
+    static_assert(rb >= 1 && rb <= 6, "the root has at most 64 slots");
 
-    const LLtype* insert(const K* const k, const V* const v, u64* const cptr) const
+    static const u32 root_slots = 1u << rb;
+    static const u32 root_bits = rb;
+    static const u32 bits = b;
+    static const u32 width = 1u << b;
+    static const u32 bottom = (64 - rb) / b;
+    static const bool fingerprints = false;
+    static const bool content_hashes = false;
+
+    static u32 root_piece(const u64 h)
     {
-        if (*(this->k) == *k)
-            return new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(this->k, v, next);
-        else if (next)
-            return new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(this->k, this->v, next->insert(k, v, cptr));
-        else
-        {
-            (*cptr)++;
-            const LLtype* const link1 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(this->k, this->v, 0);
-            const LLtype* const link0 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(k, v, link1);
-            return link0;                
-        }
+        return h & (root_slots - 1);
     }
 
-    const LLtype* remove(const K* const k, u64* const cptr) const
+    static u32 piece(const u64 h)
     {
-        if (*(this->k) == *k)
-        {
-            // Found it, remove by returning its "next" link
-            (*cptr)--;
-            return this->next;
-        }
-        else if (this->next)
+        return h & (width - 1);
+    }
+};
+
+// Geometry G with every key/value row caching its key's full hash, growing rows from 16 to 24 bytes
+// Lookups then compare hashes before dereferencing a key, so a miss that lands on an occupied
+// row costs no cache miss on the key and no call to its operator==; splitting rows and building
+// collision nodes reuse the cached hash instead of calling hash() again. Tagged pointers have no
+// spare high bits to hold a partial hash here, as the collector must see them unaltered.
+template <typename G = hamt_geometry>
+struct hamt_fingerprints : G
+{
+    static const bool fingerprints = true;
+};
+
+// Geometry G with every map keeping an order-independent hash of its contents, updated on each edit
+// hamt::hash() is then O(1), and operator== rejects most unequal maps without a traversal, so
+// maps can be used cheaply as keys of other maps. Values must support u64 hash() const.
+template <typename G = hamt_geometry>
+struct hamt_content_hashes : G
+{
+    static const bool content_hashes = true;
+};
+
+
+// Allocation policies
+// A policy is a type with static void* allocate(u64 bytes) and void deallocate(void* p, u64 bytes),
+// passed as hamt's third template argument and threaded through KV and CN. Nodes are only
+// ever deallocated when the structure knows they are unreachable (e.g., nodes a transient
+// has replaced); otherwise they live until the policy reclaims them wholesale.
+
+// Boehm GC (the default): nodes are collected once no version refers to them
+struct gc_alloc
+{
+    static void* allocate(const u64 n)
+    {
+        return GC_MALLOC(n);
+    }
+
+    static void deallocate(void* const p, const u64 n)
+    { }
+};
+
+// Registers the calling thread with the GC while in scope, so collections scan its stack
+// Threads other than main that hold gc_alloc nodes on their stacks need one; main must call
+// GC_allow_register_threads() once before such threads start. A thread the GC can't register
+// would allocate on a stack no collection scans, so failing to register aborts.
+class gc_thread_scope
+{
+    bool registered;
+
+public:
+    gc_thread_scope()
+    {
+        GC_stack_base sb;
+        const int r = GC_get_stack_base(&sb) == GC_SUCCESS ? GC_register_my_thread(&sb) : GC_UNIMPLEMENTED;
+        if (r != GC_SUCCESS && r != GC_DUPLICATE)
         {
-            const LLtype* const next = this->next->remove(k, cptr);
-            if (this->next == next)
-                return this;
-            else
-                return new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(this->k, this->v, next);
+            std::fputs("gc_thread_scope: cannot register thread with the GC\n", stderr);
+            std::abort();
         }
-        else
-            return this;
+        registered = r == GC_SUCCESS;
     }
-};
 
+    ~gc_thread_scope()
+    {
+        if (registered)
+            GC_unregister_my_thread();
+    }
+};
 
-// A key-value pair; this is both one row in Bagwell's underlying AMT
-// or a buffer of such KV rows in an internal node of the data structure 
-template <typename K, typename V, unsigned d>
-class KV
+// The process-wide table of canonical nodes behind hamt::intern (hash-consing)
+// Nodes are keyed by their bytes, i.e. their rows' bitmaps and child, key and value pointers,
+// so two nodes are equal when they hold the same pointers. Entries are weak: each hides its
+// node from the GC behind a disappearing link, which the GC clears once nothing else refers
+// to the node. Cleared entries are dropped when the table next grows. A collection may clear
+// a link and free its node at any allocation, including another thread's, so links are only
+// revealed under the GC's allocation lock, which holds collections off; once revealed, a node
+// is on the revealing thread's stack, where the GC sees it, and stays alive.
+class hamt_intern_table
 {
-    typedef KV<K,V,d> KVtype;
-    typedef KV<K,V,d+1> KVnext;
-    
-public:        
-    // We use two unions and the following cheap tagging scheme:
-    // when the lowest bit of Key k is 0, it's a key and a K*,V* pair (key and value),
-    // when the lowest bit of Key k is 1, it's either a bm (bitmap) in the top 63 bits with a 
-    // KV<K,V,d+1>* v inner node pointer when d is less than 9 or it's just a 1 and a pointer to a
-    // LL<K,V>* for collisions
-    union Key
+    struct entry
     {
-        const u64 bm;
-        const K* const key;
+        void* link;
+        u64 h;
+        u64 bytes;
+    };
 
-        Key(const K* const key) : key(key) { }
-        Key(const u64 bm) : bm(bm) { }
-    } k;
-        
-    union Val
+    entry* table;
+    u64 mask;
+    u64 used;
+    std::mutex lock;
+
+    hamt_intern_table()
+        : table(0), mask(0), used(0)
+    { }
+
+    static hamt_intern_table& global()
     {
-        const KVnext* const node;
-        const V* const val;
-            
-        Val(const KVnext* const node) : node(node) { }
-        Val(const V* const val) : val(val) { }
-    } v;
-    
-    // Empty constructor
-    KV<K,V,d>() : k((u64)0), v((V*)0) { }
-    
-    // Copy constructor
-    KV<K,V,d>(const KVtype& o) : k(o.k), v(o.v) { }
-    
-    // The different cases spelled out as constructors
-    KV<K,V,d>(const u64 bm, const KVnext* const kv) : k(bm), v(kv) { }
-    KV<K,V,d>(const K* key, const V* val) : k(key), v(val) { }
-    
-    // Equality check (doesn't actually matter which types k and v are)
-    bool operator==(const KVtype& kv) const
+        static hamt_intern_table t;
+        return t;
+    }
+
+    static u64 hash(const void* const node, const u64 bytes)
     {
-        return k.bm == kv.k.bm && v.node == kv.v.node;
+        // Nodes are whole words
+        const u64* const w = (const u64*)node;
+        u64 h = bytes;
+        for (u64 i = 0; i < bytes/sizeof(u64); ++i)
+            h = (h ^ w[i]) * 0x9e3779b97f4a7c15;
+        return h ^ (h >> 29);
     }
-    
-    // This is the find algorithm for internal nodes
-    // Given a KV row pointing to an inner node, returns the V* for a given h and key pair or 0 if none exists
-    static const V* inner_find(const KVtype& kv, const u64 h, const K* const key)
+
+    // The node in e, or 0 if the GC has cleared it; the allocation lock must be held
+    static const void* node(const entry& e)
     {
-        const u64 hpiece = (h & 0x3f) % 63;
-        
-        // bm is the bitmap indicating which elements are actually stored
-        // count is how many KV elements this inner node stores (popcount of bm)
-        // i is hpiece's index; i.e., how many KV elements *preceed* index hpiece
-        const KVnext* const data = kv.v.node;
-        const u64 bm = kv.k.bm >> 1;
+        return e.link ? GC_REVEAL_POINTER((u64)e.link) : 0;
+    }
 
-        const bool exists = bm & (1UL << hpiece);
-        if (exists)
-        {   
-            const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
-            if ((data[i].k.bm & 1) == 0)
+    static void* node_locked(void* const e)
+    {
+        return const_cast<void*>(node(*(const entry*)e));
+    }
+
+    // The node in e, or 0 if the GC has cleared it
+    static const void* reveal(entry& e)
+    {
+        return GC_call_with_alloc_lock(node_locked, &e);
+    }
+
+    // A search for the entry equal to the bytes bytes at n, whose hash is h
+    struct probe
+    {
+        entry* const table;
+        const u64 mask;
+        const void* const n;
+        const u64 h;
+        const u64 bytes;
+        entry* e;
+        const void* live;
+    };
+
+    static void* slot_locked(void* const arg)
+    {
+        probe* const p = (probe*)arg;
+        for (u64 i = p->h & p->mask; ; i = (i+1) & p->mask)
+        {
+            entry* const e = p->table+i;
+            p->e = e;
+            p->live = 0;
+            if (e->bytes == 0)
+                return 0;
+            const void* const live = e->h == p->h && e->bytes == p->bytes ? node(*e) : 0;
+            if (live && std::memcmp(live, p->n, p->bytes) == 0)
             {
-                if (*(data[i].k.key) == *key) 
-                    return data[i].v.val;
-                else
-                    return 0;
+                p->live = live;
+                return 0;
             }
-            else
-                return KVnext::inner_find(data[i], h >> 6, key);
         }
-        else
-            return 0;
     }
-    
-    // This is a helper for returning a copy of an internal node with one row replaced by kv
-    static const KVtype* update_node(const KVtype* old, const u32 count, const u32 i, const KVtype& kv)
+
+    // Returns the entry equal to node, or the empty slot where it belongs, and sets *live to
+    // that entry's node (0 for an empty slot)
+    entry* slot(const void* const n, const u64 h, const u64 bytes, const void** const live)
     {
-        KVtype* copy = (KVtype*)GC_MALLOC(count*sizeof(KVtype));
-        std::memcpy(copy, old, count*sizeof(KV));
-        new (copy+i) KVtype(kv);
-        return copy;
+        probe p = { table, mask, n, h, bytes, 0, 0 };
+        GC_call_with_alloc_lock(slot_locked, &p);
+        *live = p.live;
+        return p.e;
     }
-    
-    // Helper returns a fresh inner node for two merged h, k, v triples
-    static const KVtype new_inner_node(const u64 h0, const K* const k0, const V* const v0,
-                                       const u64 h1, const K* const k1, const V* const v1)
+
+    void link(entry* const e, const void* const n, const u64 h, const u64 bytes)
     {
-        // Take the lowest 6 bits modulo 63 
-        const u32 h0piece = (h0 & 0x3f) % 63;
-        const u32 h1piece = (h1 & 0x3f) % 63;
-        
-        if (h0piece == h1piece)
+        e->link = (void*)GC_HIDE_POINTER(n);
+        e->h = h;
+        e->bytes = bytes;
+        GC_general_register_disappearing_link(&e->link, n);
+        ++used;
+    }
+
+    void grow()
+    {
+        entry* const old = table;
+        const u64 oldsize = table ? mask+1 : 0;
+        u64 live = 0;
+        for (u64 i = 0; i < oldsize; ++i)
+            live += old[i].link != 0;
+
+        u64 size = 1024;
+        while (size < 4*live)
+            size *= 2;
+        table = (entry*)std::calloc(size, sizeof(entry));
+        if (!table)
+            throw std::bad_alloc();
+        mask = size-1;
+        used = 0;
+        for (u64 i = 0; i < oldsize; ++i)
         {
-            // Create a new node to merge them at d+1
-            const KVnext childkv = KVnext::new_inner_node(h0 >> 6, k0, v0, h1 >> 6, k1, v1);
-            KVnext* const node = (KVnext*)GC_MALLOC(sizeof(KVnext));
-            new (node+0) KVnext(childkv);
-                
-            // Return a new kv; bitmap indicates h0piece, the shared child inner node
-            return KVtype(((1UL << h0piece) << 1) | 1, node);                
+            const void* const n = reveal(old[i]);
+            GC_unregister_disappearing_link(&old[i].link);
+            const void* live;
+            if (n)
+                link(slot(n, old[i].h, old[i].bytes, &live), n, old[i].h, old[i].bytes);
         }
-        else
+        std::free(old);
+    }
+
+public:
+    // Returns the canonical node equal to the bytes bytes at n, or 0 if there is none
+    static const void* find(const void* const n, const u64 bytes)
+    {
+        hamt_intern_table& t = global();
+        std::lock_guard<std::mutex> guard(t.lock);
+        const void* live = 0;
+        if (t.table)
+            t.slot(n, hash(n, bytes), bytes, &live);
+        return live;
+    }
+
+    // As find, but makes n canonical when there is none; n must never change again. Only the
+    // start of a GC allocation can be linked, so a node that doesn't start one (such as a node
+    // inside a hamt::compact block) is copied into its own first.
+    static const void* intern(const void* const n, const u64 bytes)
+    {
+        hamt_intern_table& t = global();
+        std::lock_guard<std::mutex> guard(t.lock);
+        if (2*(t.used+1) > (t.table ? t.mask+1 : 0))
+            t.grow();
+        const u64 h = hash(n, bytes);
+        const void* live;
+        entry* const e = t.slot(n, h, bytes, &live);
+        if (live == 0)
         {
-            // The two key/value pairs exist at different buckets at this d;
-            // allocate them in proper order 
-            KVnext* const node = (KVnext*)GC_MALLOC(2*sizeof(KVnext));
-            if (h1piece < h0piece)
+            live = n;
+            if (GC_base(const_cast<void*>(n)) != n)
             {
-                new (node+0) KVnext(k1,v1);
-                new (node+1) KVnext(k0,v0);
+                live = GC_MALLOC(bytes);
+                std::memcpy(const_cast<void*>(live), n, bytes);
             }
-            else
-            {
-                new (node+0) KVnext(k0,v0);
-                new (node+1) KVnext(k1, v1);
-            }            
-
-            // Return a new kv; bitmap indicates both h0piece and h1piece
-            return KVtype((((1UL << h0piece) | (1UL << h1piece)) << 1) | 1, node);
+            t.link(e, live, h, bytes);
         }
+        return live;
     }
-    
-    // Inserts an h, k, v into an existing KV and returns a fresh KV for extended hash
-    static const KVtype insert_inner(const KVtype& kv, const u64 h, const K* const key, const V* const val, u64* const cptr)
+};
+
+
+// Plain malloc and free, for structures that free their own nodes (see rc_hamt.h)
+// hamt itself never frees nodes that versions may share, so a hamt using this policy leaks.
+struct malloc_alloc
+{
+    static void* allocate(const u64 n)
     {
-        // data is a pointer to the inner node at kv.v
-        // bm is the bitmap indicating which elements are actually stored
-        // count is how many KV elements this inner node stores (popcount of bm)
-        // i is hpiece's index; i.e., how many KV elements *preceed* index hpiece
-        const KVnext* const data = kv.v.node;
-        const u64 bm = kv.k.bm >> 1;        
-        const u32 hpiece = (h & 0x3f) % 63;
-        const u32 count = __builtin_popcountll(bm);
-        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+        void* const p = std::malloc(n);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
 
-        const bool exists = bm & (1UL << hpiece);
-        if (exists)
+    static void deallocate(void* const p, const u64 n)
+    {
+        std::free(p);
+    }
+};
+
+
+// A bump-pointer region; every node allocated from it is released at once by release()
+// or its destructor. Memory comes from malloc and is never scanned by the GC, so keys and
+// values referenced only from maps in an arena must be kept alive some other way.
+class hamt_arena
+{
+    struct chunk
+    {
+        chunk* next;
+        u64 pad;
+    };
+
+    chunk* chunks;
+    u8* cur;
+    u8* end;
+    const u64 chunksize;
+
+public:
+    explicit hamt_arena(const u64 chunksize = 1 << 20)
+        : chunks(0), cur(0), end(0), chunksize(chunksize)
+    { }
+
+    ~hamt_arena()
+    {
+        release();
+    }
+
+    void* allocate(u64 n)
+    {
+        // Keep every block 16-byte aligned
+        n = (n + 15) & ~(u64)15;
+        if ((u64)(end - cur) < n)
         {
-            // Check to see what kind of KV pair this is by checking the lowest bit of k
-            //   0 -> it's an actual K*,V* pair
-            //   1 -> it's either another inner node (KV*) or a linked list (LL<K,V>*) depending on d+1
-            if ((data[i].k.bm & 1) == 0)
-            {
-                // Does the K* match exactly?
-                if (*(data[i].k.key) == *key)
-                {
-                    // it already exists; replace the value  
-                    const KVnext* const node = KVnext::update_node(data, count, i, KVnext(key,val));
-                    return KVtype(kv.k.bm, node);
-                }                    
-                else
-                {
-                    // Merge them into a new inner node
-                    (*cptr)++;
-                    const KVnext childkv = KVnext::new_inner_node(
-                        // Passes in the first triple of h,k,v, then the second
-                        // When shifting the just-recomputed hash right, this formula is computed at compile time
-                        // This also means a warning on the d=9 template instantiation, so we do %64 as d=10
-                        // does not care in any case as it's definitely a LL*.
-                        (data[i].k.key->hash() >> ((6*(d+1)+4)) % 64), data[i].k.key, data[i].v.val,
-                        h >> 6, key, val);
-                    const KVnext* const node = KVnext::update_node(data, count, i, childkv);
-                    return KVtype(kv. k.bm, node);
-                }
-            }
-            else //if ((data[i].k & 1) == 1)
-            {
-                // an inner node is already here; recursively do an insert and replace it
-                const KVnext childkv = KVnext::insert_inner(data[i], h >> 6, key, val, cptr);
-                const KVnext* const node = KVnext::update_node(data, count, i, childkv);
-                return KVtype(kv.k.bm, node);
-            }
+            const u64 size = std::max(chunksize, n + sizeof(chunk));
+            chunk* const c = (chunk*)std::malloc(size);
+            if (!c)
+                throw std::bad_alloc();
+            c->next = chunks;
+            chunks = c;
+            cur = (u8*)(c+1);
+            end = ((u8*)c) + size;
         }
-        else
+        void* const p = cur;
+        cur += n;
+        return p;
+    }
+
+    // Frees everything allocated from this arena
+    void release()
+    {
+        while (chunks)
         {
-            // Create a new copy with this Key/Value inserted at index i
-            (*cptr)++;
-            KVnext* const node = (KVnext*)GC_MALLOC((count+1)*sizeof(KVnext));
-            std::memcpy(node, data, i*sizeof(KVnext));
-            std::memcpy(&(node[i+1]), &(data[i]), (count-i)*sizeof(KVnext));
-            new (node+i) KVnext(key, val);
-            
-            // Update the bitmap and return this new inner node as a KV
-            return KVtype(((bm | (1UL << hpiece)) << 1) | 1, node);
+            chunk* const next = chunks->next;
+            std::free(chunks);
+            chunks = next;
         }
+        cur = end = 0;
     }
-    
-    // Removes a single arbitrary key/value and sets keyPtr/valPtr
-    static const KVtype removeFirst_inner(const KVtype& kv, const K** const keyPtr, const V** const valPtr)
-    { 
-        const KVnext* const data = kv.v.node;
-        const u64 bm = kv.k.bm >> 1;
-        const u32 count = __builtin_popcountll(bm);
 
-        if (data[0].k.bm & 1)
+    // The arena arena_alloc allocates from on this thread
+    static hamt_arena*& current()
+    {
+        static thread_local hamt_arena* arena = 0;
+        return arena;
+    }
+
+    // Makes an arena current for the lifetime of this object
+    class scope
+    {
+        hamt_arena* const prev;
+
+    public:
+        explicit scope(hamt_arena& a)
+            : prev(current())
         {
-            // Remove first from inner node
-            const KVnext childkv = KVnext::removeFirst_inner(data[0], keyPtr, valPtr);
+            current() = &a;
+        }
 
-            // If a new inner node comes back, build an updated node with the same bm
-            if (childkv.k.bm != 0)
-            {
-                const KVnext* const node = KVnext::update_node(data, count, 0, childkv);
-                return KVtype(kv.k.bm, node);
-            }
-            // Otherwise, fall through and shrink the node
+        ~scope()
+        {
+            current() = prev;
         }
-        else
+    };
+};
+
+// Allocates from hamt_arena::current(), for phase-scoped maps that are all discarded together
+struct arena_alloc
+{
+    static void* allocate(const u64 n)
+    {
+        return hamt_arena::current()->allocate(n);
+    }
+
+    static void deallocate(void* const p, const u64 n)
+    { }
+};
+
+
+// Size-class free lists carved from an arena
+// Nodes are 1-63 rows of 16 bytes (24 with fingerprints), so blocks are rounded up to multiples of 16 bytes and
+// each size class keeps its own free list; freed blocks (such as the nodes a transient
+// replaces) are reused for the next allocation of that class. Larger blocks simply come
+// from the arena. As with hamt_arena, release() frees everything at once.
+class hamt_pool
+{
+    static const u32 classes = 96;
+
+    hamt_arena region;
+    void* freelist[classes];
+
+public:
+    hamt_pool()
+        : region(), freelist{}
+    { }
+
+    void* allocate(const u64 n)
+    {
+        const u64 c = (n + 15) >> 4;
+        if (c < classes && freelist[c])
+        {
+            void* const p = freelist[c];
+            freelist[c] = *(void**)p;
+            return p;
+        }
+        return region.allocate(n);
+    }
+
+    void deallocate(void* const p, const u64 n)
+    {
+        const u64 c = (n + 15) >> 4;
+        if (p && c > 0 && c < classes)
+        {
+            *(void**)p = freelist[c];
+            freelist[c] = p;
+        }
+    }
+
+    void release()
+    {
+        region.release();
+        std::memset(freelist, 0, sizeof(freelist));
+    }
+
+    // The pool pool_alloc uses on this thread
+    static hamt_pool& local()
+    {
+        static thread_local hamt_pool pool;
+        return pool;
+    }
+};
+
+// Allocates from the calling thread's hamt_pool
+struct pool_alloc
+{
+    static void* allocate(const u64 n)
+    {
+        return hamt_pool::local().allocate(n);
+    }
+
+    static void deallocate(void* const p, const u64 n)
+    {
+        hamt_pool::local().deallocate(p, n);
+    }
+};
+
+
+// A flat node for storing collisions after d=10 layers of inner nodes KV -> KV*
+// A single allocation holds count full hashes followed by count key/value pairs. Keys that
+// reach this depth only share the hash pieces used above, so lookups first scan the cached
+// hashes (several per instruction where SSE2 or AVX2 is available) and only compare keys
+// whose hash matches. A weak hash then costs a linear scan of contiguous memory rather
+// than a pointer chase per colliding key. Nodes are immutable once built, and always hold
+// at least two pairs.
+template <typename K, typename V, typename A>
+class CN
+{
+    typedef CN<K,V,A> CNtype;
+
+public:
+    struct Pair
+    {
+        const K* k;
+        const V* v;
+    };
+
+    const u64 count;
+
+private:
+    CN<K,V,A>(const u64 count)
+        : count(count)
+    { }
+
+    u64* hashes()
+    {
+        return reinterpret_cast<u64*>(this+1);
+    }
+
+    Pair* pairs()
+    {
+        return reinterpret_cast<Pair*>(hashes()+count);
+    }
+
+public:
+    // The size of a node holding count pairs
+    static u64 bytes(const u64 count)
+    {
+        return sizeof(CNtype) + count*(sizeof(u64)+sizeof(Pair));
+    }
+
+    // Allocates an uninitialized node for count pairs
+    static CNtype* make(const u64 count)
+    {
+        void* const mem = A::allocate(bytes(count));
+        return new (mem) CNtype(count);
+    }
+
+    static const CNtype* make(const u64 h0, const K* const k0, const V* const v0,
+                              const u64 h1, const K* const k1, const V* const v1)
+    {
+        CNtype* const cn = make(2);
+        cn->set(0, h0, k0, v0);
+        cn->set(1, h1, k1, v1);
+        return cn;
+    }
+
+    void set(const u64 i, const u64 h, const K* const k, const V* const v)
+    {
+        hashes()[i] = h;
+        pairs()[i].k = k;
+        pairs()[i].v = v;
+    }
+
+    const u64* hashes() const
+    {
+        return reinterpret_cast<const u64*>(this+1);
+    }
+
+    const Pair* pairs() const
+    {
+        return reinterpret_cast<const Pair*>(hashes()+count);
+    }
+
+    // Returns the index of key (whose full hash is h), or count if it's absent
+    // Each step compares a block of cached hashes at once and only visits keys that match.
+    // key may be a K or any probe type P for which K == P is defined and hashes alike.
+    template <typename P>
+    u64 index_of(const u64 h, const P& key) const
+    {
+        const u64* const hs = hashes();
+        const Pair* const ps = pairs();
+        u64 i = 0;
+#if defined(__AVX2__)
+        const __m256i needle = _mm256_set1_epi64x(h);
+        for (; i+4 <= count; i += 4)
+        {
+            const __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(hs+i)), needle);
+            for (u32 m = _mm256_movemask_pd(_mm256_castsi256_pd(eq)); m; m &= m-1)
+                if (*(ps[i+__builtin_ctz(m)].k) == key)
+                    return i+__builtin_ctz(m);
+        }
+#elif defined(__SSE2__)
+        // SSE2 has no 64-bit compare, so a lane matches when both of its 32-bit halves do
+        const __m128i needle = _mm_set1_epi64x(h);
+        for (; i+2 <= count; i += 2)
+        {
+            const __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(hs+i)), needle);
+            const __m128i both = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2,3,0,1)));
+            for (u32 m = _mm_movemask_pd(_mm_castsi128_pd(both)); m; m &= m-1)
+                if (*(ps[i+__builtin_ctz(m)].k) == key)
+                    return i+__builtin_ctz(m);
+        }
+#endif
+        for (; i < count; ++i)
+            if (hs[i] == h && *(ps[i].k) == key)
+                return i;
+        return count;
+    }
+
+    template <typename P>
+    const V* find(const u64 h, const P& key) const
+    {
+        const u64 i = index_of(h, key);
+        return i < count ? pairs()[i].v : 0;
+    }
+
+    // Returns a copy with key set to v, appending it if absent
+    const CNtype* insert(const u64 h, const K* const key, const V* const v, u64* const cptr) const
+    {
+        auto f = [v](const V* const old) { return v; };
+        return update(h, key, f, cptr);
+    }
+
+    // Returns a copy with key set to f(old), where old is its value or 0 if it's absent,
+    // or this node itself if f(old) is old
+    template <typename F>
+    const CNtype* update(const u64 h, const K* const key, F& f, u64* const cptr) const
+    {
+        const u64 i = index_of(h, *key);
+        const V* const old = i < count ? pairs()[i].v : 0;
+        const V* const v = f(old);
+        if (v == old)
+            return this;
+        else if (i < count)
+        {
+            CNtype* const cn = make(count);
+            std::memcpy(cn->hashes(), hashes(), count*(sizeof(u64)+sizeof(Pair)));
+            cn->pairs()[i].v = v;
+            return cn;
+        }
+
+        (*cptr)++;
+        CNtype* const cn = make(count+1);
+        std::memcpy(cn->hashes(), hashes(), count*sizeof(u64));
+        std::memcpy(cn->pairs(), pairs(), count*sizeof(Pair));
+        cn->set(count, h, key, v);
+        return cn;
+    }
+
+    // Returns a copy without the pair at index i
+    const CNtype* remove_at(const u64 i) const
+    {
+        CNtype* const cn = make(count-1);
+        std::memcpy(cn->hashes(), hashes(), i*sizeof(u64));
+        std::memcpy(cn->hashes()+i, hashes()+i+1, (count-1-i)*sizeof(u64));
+        std::memcpy(cn->pairs(), pairs(), i*sizeof(Pair));
+        std::memcpy(cn->pairs()+i, pairs()+i+1, (count-1-i)*sizeof(Pair));
+        return cn;
+    }
+
+    // Calls f(k, v) on every pair in the node, in order
+    template <typename F>
+    void for_each(F& f) const
+    {
+        const Pair* const ps = pairs();
+        for (u64 i = 0; i < count; ++i)
+            f(ps[i].k, ps[i].v);
+    }
+
+    // As for_each, but calls f(h, k, v) with each key's cached full hash h
+    template <typename F>
+    void for_each_hashed(F& f) const
+    {
+        const u64* const hs = hashes();
+        const Pair* const ps = pairs();
+        for (u64 i = 0; i < count; ++i)
+            f(hs[i], ps[i].k, ps[i].v);
+    }
+};
+
+
+// Records which inner nodes a transient owns, and how many rows each has room for
+// Owned nodes were allocated by that transient and are reachable from nowhere else,
+// so it may update them in place. This is an open-addressed table keyed by node address.
+template <typename A>
+class hamt_edit
+{
+    struct entry
+    {
+        const void* node;
+        u64 cap;
+    };
+
+    entry* table;
+    u64 mask;
+    u64 used;
+
+    u64 slot(const void* const node) const
+    {
+        return ((((u64)node) >> 4) * 0x9e3779b97f4a7c15) >> 20 & mask;
+    }
+
+    void grow()
+    {
+        entry* const old = table;
+        const u64 oldsize = table ? mask+1 : 0;
+        const u64 size = oldsize ? 2*oldsize : 64;
+        table = (entry*)A::allocate(size*sizeof(entry));
+        std::memset(table, 0, size*sizeof(entry));
+        mask = size-1;
+        used = 0;
+        for (u64 i = 0; i < oldsize; ++i)
+            if (old[i].node)
+                own(old[i].node, old[i].cap);
+        A::deallocate(old, oldsize*sizeof(entry));
+    }
+
+public:
+    hamt_edit()
+        : table(0), mask(0), used(0)
+    { }
+
+    // Returns true if node is owned, setting *cap to its capacity in rows
+    bool owns(const void* const node, u32* const cap) const
+    {
+        if (!table)
+            return false;
+        for (u64 i = slot(node); table[i].node; i = (i+1) & mask)
+            if (table[i].node == node)
+            {
+                *cap = table[i].cap;
+                return true;
+            }
+        return false;
+    }
+
+    void own(const void* const node, const u32 cap)
+    {
+        if (2*(used+1) > (table ? mask+1 : 0))
+            grow();
+        u64 i = slot(node);
+        while (table[i].node)
+            i = (i+1) & mask;
+        table[i].node = node;
+        table[i].cap = cap;
+        ++used;
+    }
+
+    void disown(const void* const node)
+    {
+        if (!table)
+            return;
+        u64 i = slot(node);
+        while (table[i].node != node)
+        {
+            if (!table[i].node)
+                return;
+            i = (i+1) & mask;
+        }
+
+        // Backward-shift deletion keeps every remaining probe sequence unbroken
+        for (u64 j = (i+1) & mask; table[j].node; j = (j+1) & mask)
+        {
+            const u64 home = slot(table[j].node);
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].node = 0;
+        --used;
+    }
+
+    // Disowns and deallocates an owned node that is no longer referenced anywhere
+    void release(const void* const node, const u64 bytes)
+    {
+        disown(node);
+        A::deallocate(const_cast<void*>(node), bytes);
+    }
+
+    // Forgets every owned node in O(1); they become shared, immutable nodes again
+    void reset()
+    {
+        A::deallocate(table, table ? (mask+1)*sizeof(entry) : 0);
+        table = 0;
+        mask = 0;
+        used = 0;
+    }
+
+    // Returns node data with row i replaced by row, updating data in place when it is
+    // owned and otherwise copying it into a fresh node that is then owned
+    template <typename R>
+    const R* replace_row(const R* const data, const u32 count, const u32 i, const R& row, const bool owned)
+    {
+        R* node = const_cast<R*>(data);
+        if (!owned)
+        {
+            node = (R*)A::allocate(count*sizeof(R));
+            std::memcpy(node, data, count*sizeof(R));
+            own(node, count);
+        }
+        new (node+i) R(row);
+        return node;
+    }
+
+    // Returns node data with row inserted at index i, shifting rows in place when data is
+    // owned and has spare capacity, and otherwise moving them to a larger owned node
+    template <typename R>
+    const R* insert_row(const R* const data, const u32 count, const u32 i, const R& row, const bool owned, const u32 cap,
+                        const u32 width)
+    {
+        R* node = const_cast<R*>(data);
+        if (owned && cap > count)
+            std::memmove(node+i+1, node+i, (count-i)*sizeof(R));
+        else
+        {
+            const u32 newcap = grow_capacity(count+1, width);
+            node = (R*)A::allocate(newcap*sizeof(R));
+            std::memcpy(node, data, i*sizeof(R));
+            std::memcpy(node+i+1, data+i, (count-i)*sizeof(R));
+            if (owned)
+                release(data, cap*sizeof(R));
+            own(node, newcap);
+        }
+        new (node+i) R(row);
+        return node;
+    }
+
+    // Returns node data with row i removed (count must be at least 2), shifting rows in place when data is owned
+    template <typename R>
+    const R* remove_row(const R* const data, const u32 count, const u32 i, const bool owned)
+    {
+        R* node = const_cast<R*>(data);
+        if (owned)
+            std::memmove(node+i, node+i+1, (count-1-i)*sizeof(R));
+        else
+        {
+            node = (R*)A::allocate((count-1)*sizeof(R));
+            std::memcpy(node, data, i*sizeof(R));
+            std::memcpy(node+i, data+i+1, (count-1-i)*sizeof(R));
+            own(node, count-1);
+        }
+        return node;
+    }
+
+    // The capacity to give an owned node that must hold count rows
+    // Doubling keeps a run of inserts into one node amortized O(1); width rows is the most any node holds
+    static u32 grow_capacity(const u32 count, const u32 width)
+    {
+        return std::min(width, std::max(2u, 2*count));
+    }
+};
+
+
+// One key/value pair staged for a bottom-up build (see hamt::from_range)
+// path packs every hash piece, most significant first: the root piece in the top root_bits
+// bits, then the piece for each depth d in the next bits bits (with the default geometry, the
+// root piece is in bits 60-62 and the 6-bit piece for depth d in bits 54-6d up to 59-6d).
+// Sorting by path therefore groups pairs exactly as the trie would place them. h is the key's full hash.
+template <typename K, typename V>
+struct KVstaged
+{
+    u64 path;
+    u64 h;
+    const K* k;
+    const V* v;
+
+    bool operator<(const KVstaged<K,V>& o) const
+    {
+        return path < o.path;
+    }
+};
+
+
+// The key hash a row caches when its geometry has fingerprints, and nothing otherwise
+// Only key/value rows keep a hash; other rows hold 0. Empty as a base class, this adds no
+// bytes to a row in the default geometries.
+template <typename K, bool fingerprints>
+class KVfingerprint
+{
+public:
+    KVfingerprint(const u64 h) { }
+
+    // The full hash of key, the key of this key/value row
+    u64 key_hash(const K* const key) const
+    {
+        return key->hash();
+    }
+
+    // False only when this row's key certainly differs from one whose full hash is h
+    bool may_match(const u64 h) const
+    {
+        return true;
+    }
+};
+
+template <typename K>
+class KVfingerprint<K,true>
+{
+    const u64 fingerprint;
+
+public:
+    KVfingerprint(const u64 h) : fingerprint(h) { }
+
+    u64 key_hash(const K* const key) const
+    {
+        return fingerprint;
+    }
+
+    bool may_match(const u64 h) const
+    {
+        return fingerprint == h;
+    }
+};
+
+
+// A key-value pair; this is both one row in Bagwell's underlying AMT
+// or a buffer of such KV rows in an internal node of the data structure 
+template <typename K, typename V, unsigned d, typename A, typename G, bool bottom = (d == G::bottom)>
+class KV : public KVfingerprint<K, G::fingerprints>
+{
+    typedef KV<K,V,d,A,G> KVtype;
+    typedef KV<K,V,d+1,A,G> KVnext;
+    typedef KVfingerprint<K, G::fingerprints> KVhash;
+
+    // How far a full hash is shifted right to leave the piece that selects among this depth's children
+    static const u32 shift = G::root_bits + G::bits*d;
+    
+public:        
+    // We use two unions and the following cheap tagging scheme:
+    // when the lowest bit of Key k is 0, it's a key and a K*,V* pair (key and value),
+    // when the lowest bit of Key k is 1, it's either a bm (bitmap) in the top 63 bits with a 
+    // KV<K,V,d+1,A,G>* v inner node pointer when d+1 is less than G::bottom or it's just a 1 and a pointer to a
+    // CN<K,V,A>* for collisions
+    union Key
+    {
+        const u64 bm;
+        const K* const key;
+
+        Key(const K* const key) : key(key) { }
+        Key(const u64 bm) : bm(bm) { }
+    } k;
+        
+    union Val
+    {
+        const KVnext* const node;
+        const V* const val;
+            
+        Val(const KVnext* const node) : node(node) { }
+        Val(const V* const val) : val(val) { }
+    } v;
+    
+    // Empty constructor
+    KV() : KVhash(0), k((u64)0), v((V*)0) { }
+    
+    // Copy constructor
+    KV(const KVtype& o) : KVhash(o), k(o.k), v(o.v) { }
+    
+    // The different cases spelled out as constructors; h is key's full hash
+    KV(const u64 bm, const KVnext* const kv) : KVhash(0), k(bm), v(kv) { }
+    KV(const K* key, const V* val, const u64 h) : KVhash(h), k(key), v(val) { }
+
+    // The key/value row pair with its value replaced by val
+    KV(const KVtype& pair, const V* val) : KVhash(pair), k(pair.k), v(val) { }
+
+    // The key/value row pair with its key and value moved to copies at key and val
+    KV(const KVtype& pair, const K* key, const V* val) : KVhash(pair), k(key), v(val) { }
+
+    // The full hash of this key/value row's key
+    u64 key_hash() const
+    {
+        return KVhash::key_hash(k.key);
+    }
+    
+    // Equality check (doesn't actually matter which types k and v are)
+    bool operator==(const KVtype& kv) const
+    {
+        return k.bm == kv.k.bm && v.node == kv.v.node;
+    }
+    
+    // This is the find algorithm for internal nodes
+    // Given a KV row pointing to an inner node, returns the V* for a given full hash fh and key or 0 if none exists
+    // key may be a K or any probe type P for which K == P is defined and hashes alike
+    template <typename P>
+    static const V* inner_find(const KVtype& kv, const u64 fh, const P& key)
+    {
+        const u64 hpiece = G::piece(fh >> shift);
+        
+        // bm is the bitmap indicating which elements are actually stored
+        // count is how many KV elements this inner node stores (popcount of bm)
+        // i is hpiece's index; i.e., how many KV elements *preceed* index hpiece
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+
+        const bool exists = bm & (1UL << hpiece);
+        if (exists)
+        {   
+            const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+            if ((data[i].k.bm & 1) == 0)
+            {
+                if (data[i].may_match(fh) && *(data[i].k.key) == key) 
+                    return data[i].v.val;
+                else
+                    return 0;
+            }
+            else
+                return KVnext::inner_find(data[i], fh, key);
+        }
+        else
+            return 0;
+    }
+
+    // As inner_find, but returns the key/value row stored for key (as a row at this depth),
+    // or an empty row if none exists
+    template <typename P>
+    static const KVtype inner_find_row(const KVtype& kv, const u64 fh, const P& key)
+    {
+        const u64 hpiece = G::piece(fh >> shift);
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+        if (!(bm & (1UL << hpiece)))
+            return KVtype();
+
+        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+        if ((data[i].k.bm & 1) == 1)
+            return lifted(KVnext::inner_find_row(data[i], fh, key));
+        else if (data[i].may_match(fh) && *(data[i].k.key) == key)
+            return lifted(data[i]);
+        else
+            return KVtype();
+    }
+    
+    // This is a helper for returning a copy of an internal node with one row replaced by kv
+    static const KVtype* update_node(const KVtype* old, const u32 count, const u32 i, const KVtype& kv)
+    {
+        KVtype* copy = (KVtype*)A::allocate(count*sizeof(KVtype));
+        std::memcpy(copy, old, count*sizeof(KV));
+        new (copy+i) KVtype(kv);
+        return copy;
+    }
+    
+    // Helper returns a fresh inner node for two merged fh, k, v triples, where fh0 and fh1 are full hashes
+    static const KVtype new_inner_node(const u64 fh0, const K* const k0, const V* const v0,
+                                       const u64 fh1, const K* const k1, const V* const v1)
+    {
+        // Take this depth's piece of each hash
+        const u32 h0piece = G::piece(fh0 >> shift);
+        const u32 h1piece = G::piece(fh1 >> shift);
+        
+        if (h0piece == h1piece)
+        {
+            // Create a new node to merge them at d+1
+            const KVnext childkv = KVnext::new_inner_node(fh0, k0, v0, fh1, k1, v1);
+            KVnext* const node = (KVnext*)A::allocate(sizeof(KVnext));
+            new (node+0) KVnext(childkv);
+                
+            // Return a new kv; bitmap indicates h0piece, the shared child inner node
+            return KVtype(((1UL << h0piece) << 1) | 1, node);                
+        }
+        else
+        {
+            // The two key/value pairs exist at different buckets at this d;
+            // allocate them in proper order 
+            KVnext* const node = (KVnext*)A::allocate(2*sizeof(KVnext));
+            if (h1piece < h0piece)
+            {
+                new (node+0) KVnext(k1,v1,fh1);
+                new (node+1) KVnext(k0,v0,fh0);
+            }
+            else
+            {
+                new (node+0) KVnext(k0,v0,fh0);
+                new (node+1) KVnext(k1, v1, fh1);
+            }            
+
+            // Return a new kv; bitmap indicates both h0piece and h1piece
+            return KVtype((((1UL << h0piece) | (1UL << h1piece)) << 1) | 1, node);
+        }
+    }
+    
+    // Inserts an fh, k, v into an existing KV and returns a fresh KV for extended hash
+    // fh is key's full hash; each depth takes its own piece of it, and new key/value rows keep it
+    static const KVtype insert_inner(const KVtype& kv, const u64 fh, const K* const key, const V* const val, u64* const cptr)
+    {
+        auto f = [val](const V* const old) { return val; };
+        return update_inner(kv, fh, key, f, cptr);
+    }
+
+    // Sets key (whose full hash is fh) beneath the inner-node row kv to f(v) in one traversal,
+    // where v is its current value or 0 if it's absent. Returns kv itself, allocating nothing,
+    // when f(v) is v; f must not return 0 for a key that is present.
+    template <typename F>
+    static const KVtype update_inner(const KVtype& kv, const u64 fh, const K* const key, F& f, u64* const cptr)
+    {
+        // data is a pointer to the inner node at kv.v
+        // bm is the bitmap indicating which elements are actually stored
+        // count is how many KV elements this inner node stores (popcount of bm)
+        // i is hpiece's index; i.e., how many KV elements *preceed* index hpiece
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;        
+        const u32 hpiece = G::piece(fh >> shift);
+        const u32 count = __builtin_popcountll(bm);
+        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+
+        const bool exists = bm & (1UL << hpiece);
+        if (exists)
+        {
+            // Check to see what kind of KV pair this is by checking the lowest bit of k
+            //   0 -> it's an actual K*,V* pair
+            //   1 -> it's either another inner node (KV*) or a collision node (CN<K,V,A>*) depending on d+1
+            if ((data[i].k.bm & 1) == 0)
+            {
+                // Does the K* match exactly?
+                if (data[i].may_match(fh) && *(data[i].k.key) == *key)
+                {
+                    // it already exists; replace the value unless it's unchanged
+                    const V* const val = f(data[i].v.val);
+                    if (val == data[i].v.val)
+                        return kv;
+                    const KVnext* const node = KVnext::update_node(data, count, i, KVnext(key,val,fh));
+                    return KVtype(kv.k.bm, node);
+                }                    
+                else
+                {
+                    // Merge them into a new inner node
+                    const V* const val = f(0);
+                    if (val == 0)
+                        return kv;
+                    (*cptr)++;
+                    const KVnext childkv = KVnext::new_inner_node(
+                        // Passes in the first triple of fh,k,v, then the second
+                        data[i].key_hash(), data[i].k.key, data[i].v.val,
+                        fh, key, val);
+                    const KVnext* const node = KVnext::update_node(data, count, i, childkv);
+                    return KVtype(kv. k.bm, node);
+                }
+            }
+            else //if ((data[i].k & 1) == 1)
+            {
+                // an inner node is already here; recursively do an update and replace it
+                const KVnext childkv = KVnext::update_inner(data[i], fh, key, f, cptr);
+                if (childkv == data[i])
+                    return kv;
+                const KVnext* const node = KVnext::update_node(data, count, i, childkv);
+                return KVtype(kv.k.bm, node);
+            }
+        }
+        else
+        {
+            // Create a new copy with this Key/Value inserted at index i
+            const V* const val = f(0);
+            if (val == 0)
+                return kv;
+            (*cptr)++;
+            KVnext* const node = (KVnext*)A::allocate((count+1)*sizeof(KVnext));
+            std::memcpy(node, data, i*sizeof(KVnext));
+            std::memcpy(&(node[i+1]), &(data[i]), (count-i)*sizeof(KVnext));
+            new (node+i) KVnext(key, val, fh);
+            
+            // Update the bitmap and return this new inner node as a KV
+            return KVtype(((bm | (1UL << hpiece)) << 1) | 1, node);
+        }
+    }
+    
+    // Removes a single arbitrary key/value and sets keyPtr/valPtr
+    static const KVtype removeFirst_inner(const KVtype& kv, const K** const keyPtr, const V** const valPtr)
+    { 
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+        const u32 count = __builtin_popcountll(bm);
+
+        if (data[0].k.bm & 1)
+        {
+            // Remove first from inner node
+            const KVnext childkv = KVnext::removeFirst_inner(data[0], keyPtr, valPtr);
+
+            // If a new inner node comes back, build an updated node with the same bm
+            // (or, if it's now a lone pair, move the pair up in place of this node)
+            if (childkv.k.bm != 0)
+            {
+                if (count == 1 && (childkv.k.bm & 1) == 0)
+                    return lifted(childkv);
+                const KVnext* const node = KVnext::update_node(data, count, 0, childkv);
+                return KVtype(kv.k.bm, node);
+            }
+            // Otherwise, fall through and shrink the node
+        }
+        else
+        {
+            // This key/value is next
+            *keyPtr = data[0].k.key;
+            *valPtr = data[0].v.val;
+        }
+
+        // If either a key/value or whole inner node was removed, shrink this inner node
+        return without_row(data, bm, count, __builtin_ctzll(bm));
+    }
+
+    // A key/value row from the node beneath this depth, moved up into a row at this depth
+    // (rows have the same layout at every depth)
+    static const KVtype lifted(const KVnext& pair)
+    {
+        KVtype row;
+        std::memcpy(&row, &pair, sizeof(KVtype));
+        return row;
+    }
+
+    // Returns the row for the inner node data (with bitmap bm and count rows) without its row
+    // for hash piece hpiece. Removals keep the trie canonical, shaped as if the remaining keys
+    // had only ever been inserted: a node left with no rows becomes an empty row, and one left
+    // with a lone key/value pair is replaced by that pair.
+    static const KVtype without_row(const KVnext* const data, const u64 bm, const u32 count, const u32 hpiece)
+    {
+        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+        if (count == 1)
+            return KVtype();
+        else if (count == 2 && (data[1-i].k.bm & 1) == 0)
+            return lifted(data[1-i]);
+
+        KVnext* const node = (KVnext*)A::allocate((count-1)*sizeof(KVnext));
+        std::memcpy(node, data, i*sizeof(KVnext));
+        std::memcpy(&(node[i]), &(data[i+1]), (count-1-i)*sizeof(KVnext));
+
+        // Remove this hpiece from the bitmap
+        const u64 newbm = ((bm & (0xffffffffffffffff ^ (1UL << hpiece))) << 1) | 1;
+        return KVtype(newbm, node);
+    }
+
+    // Removes key (whose full hash is fh) from kv and returns an updated KV
+    static const KVtype remove_inner(const KVtype& kv, const u64 fh, const K* const key, u64* const cptr)
+    {
+        // We follow the same basic structure as insert_inner; first, calculate the next hash piece
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+        const u32 hpiece = G::piece(fh >> shift);
+        const u32 count = __builtin_popcountll(bm);
+        
+        const bool exists = bm & (1UL << hpiece);
+        if (exists)
+        {
+            const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+            
+            // Check to see what kind of KV pair this is by checking the lowest bit of k
+            if ((data[i].k.bm & 1) == 0)
+            {
+                // Does the K* match exactly?
+                if (data[i].may_match(fh) && *(data[i].k.key) == *key)
+                {
+                    // Create a new node, removing this kv
+                    (*cptr)--;
+                    return without_row(data, bm, count, hpiece);
+                }
+                else
+                    // Key is already absent
+                    return kv;
+            }
+            else //if ((data[i].k & 1) == 1)
+            {
+                // Try a remove_inner and see what comes back
+                const KVnext childkv = KVnext::remove_inner(data[i], fh, key, cptr);
+                if (childkv == data[i])
+                    // Key was already absent within child node
+                    return kv;
+                else if (childkv.k.bm == 0)
+                    return without_row(data, bm, count, hpiece);
+                else if (count == 1 && (childkv.k.bm & 1) == 0)
+                    // The child is down to a lone pair, which takes this node's place
+                    return lifted(childkv);
+                else 
+                {
+                    const KVnext* const node = KVnext::update_node(data, count, i, childkv);
+                    return KVtype(kv.k.bm, node);
+                }
+            }
+        }
+        else
+            // Key is already absent
+            return kv;
+    }
+
+    // Marks the chain of fresh nodes under a row built by new_inner_node as owned by edit
+    static void own_new_node(const KVtype& kv, hamt_edit<A>* const edit)
+    {
+        const KVnext* const data = kv.v.node;
+        const u32 count = __builtin_popcountll(kv.k.bm >> 1);
+        edit->own(data, count);
+        if (count == 1)
+            KVnext::own_new_node(data[0], edit);
+    }
+
+    // The transient counterpart of insert_inner
+    // may_own is true when the node holding row kv is owned by edit; only then can kv's own
+    // inner node be owned, as owned nodes are only ever placed into other owned nodes.
+    // If kv's inner node was updated in place, kv itself is returned.
+    static const KVtype insert_inner_t(const KVtype& kv, const u64 fh, const K* const key, const V* const val,
+                                       u64* const cptr, hamt_edit<A>* const edit, const bool may_own)
+    {
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+        const u32 hpiece = G::piece(fh >> shift);
+        const u32 count = __builtin_popcountll(bm);
+        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+        u32 cap = 0;
+        const bool owned = may_own && edit->owns(data, &cap);
+
+        const bool exists = bm & (1UL << hpiece);
+        if (exists)
+        {
+            if ((data[i].k.bm & 1) == 0)
+            {
+                if (data[i].may_match(fh) && *(data[i].k.key) == *key)
+                {
+                    // it already exists; replace the value
+                    const KVnext* const node = edit->replace_row(data, count, i, KVnext(key,val,fh), owned);
+                    return KVtype(kv.k.bm, node);
+                }
+                else
+                {
+                    // Merge them into a new inner node, which is fresh and so owned from the start
+                    (*cptr)++;
+                    const KVnext childkv = KVnext::new_inner_node(data[i].key_hash(), data[i].k.key, data[i].v.val,
+                                                                  fh, key, val);
+                    KVnext::own_new_node(childkv, edit);
+                    const KVnext* const node = edit->replace_row(data, count, i, childkv, owned);
+                    return KVtype(kv.k.bm, node);
+                }
+            }
+            else
+            {
+                // an inner node is already here; recursively insert and replace it unless it was edited in place
+                const KVnext childkv = KVnext::insert_inner_t(data[i], fh, key, val, cptr, edit, owned);
+                if (childkv == data[i])
+                    return kv;
+                const KVnext* const node = edit->replace_row(data, count, i, childkv, owned);
+                return KVtype(kv.k.bm, node);
+            }
+        }
+        else
+        {
+            (*cptr)++;
+            const KVnext* const node = edit->insert_row(data, count, i, KVnext(key, val, fh), owned, cap, G::width);
+            return KVtype(((bm | (1UL << hpiece)) << 1) | 1, node);
+        }
+    }
+
+    // The transient counterpart of remove_inner; may_own is as for insert_inner_t
+    static const KVtype remove_inner_t(const KVtype& kv, const u64 fh, const K* const key,
+                                       u64* const cptr, hamt_edit<A>* const edit, const bool may_own)
+    {
+        const KVnext* const data = kv.v.node;
+        const u64 bm = kv.k.bm >> 1;
+        const u32 hpiece = G::piece(fh >> shift);
+        const u32 count = __builtin_popcountll(bm);
+
+        const bool exists = bm & (1UL << hpiece);
+        if (!exists)
+            // Key is already absent
+            return kv;
+
+        const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+        u32 cap = 0;
+        const bool owned = may_own && edit->owns(data, &cap);
+        if ((data[i].k.bm & 1) == 0)
+        {
+            if (!data[i].may_match(fh) || !(*(data[i].k.key) == *key))
+                // Key is already absent
+                return kv;
+            (*cptr)--;
+        }
+        else
+        {
+            const KVnext childkv = KVnext::remove_inner_t(data[i], fh, key, cptr, edit, owned);
+            if (childkv == data[i])
+                return kv;
+            else if (count == 1 && (childkv.k.bm & 1) == 0 && childkv.k.bm != 0)
+            {
+                // The child is down to a lone pair, which takes this node's place
+                if (owned)
+                    edit->release(data, cap*sizeof(KVnext));
+                return lifted(childkv);
+            }
+            else if (childkv.k.bm != 0)
+            {
+                const KVnext* const node = edit->replace_row(data, count, i, childkv, owned);
+                return KVtype(kv.k.bm, node);
+            }
+            // Otherwise the child is now empty, fall through and drop its row
+        }
+
+        // As in without_row, a node left empty or with a lone pair goes
+        if (count == 1 || (count == 2 && (data[1-i].k.bm & 1) == 0))
+        {
+            const KVtype rest = count == 1 ? KVtype() : lifted(data[1-i]);
+            if (owned)
+                edit->release(data, cap*sizeof(KVnext));
+            return rest;
+        }
+        else
+        {
+            const KVnext* const node = edit->remove_row(data, count, i, owned);
+            const u64 newbm = ((bm & (0xffffffffffffffff ^ (1UL << hpiece))) << 1) | 1;
+            return KVtype(newbm, node);
+        }
+    }
+
+    // Builds the inner-node row for staged pairs [lo, hi), which number at least two, are
+    // sorted by path, and share every hash piece above this depth. Each node is allocated
+    // once, at its final size.
+    static const KVtype build_inner(const KVstaged<K,V>* const staged, const u64 lo, const u64 hi)
+    {
+        const u32 pathshift = 64 - G::root_bits - G::bits*(d+1);
+        const u64 mask = (1UL << G::bits) - 1;
+        u64 bm = 0;
+        for (u64 j = lo; j < hi; ++j)
+            bm |= 1UL << ((staged[j].path >> pathshift) & mask);
+
+        KVnext* const node = (KVnext*)A::allocate(__builtin_popcountll(bm)*sizeof(KVnext));
+        u32 i = 0;
+        for (u64 j = lo; j < hi; ++i)
+        {
+            // Find the run of pairs sharing this hash piece
+            const u64 hpiece = (staged[j].path >> pathshift) & mask;
+            u64 end = j+1;
+            while (end < hi && ((staged[end].path >> pathshift) & mask) == hpiece)
+                ++end;
+
+            if (end - j == 1)
+                new (node+i) KVnext(staged[j].k, staged[j].v, staged[j].h);
+            else
+                new (node+i) KVnext(KVnext::build_inner(staged, j, end));
+            j = end;
+        }
+
+        return KVtype((bm << 1) | 1, node);
+    }
+
+    // Returns how many key/value pairs are stored beneath row kv (0 if it's empty, 1 if it's a pair)
+    static u64 row_size(const KVtype& kv)
+    {
+        if (kv.k.bm == 0)
+            return 0;
+        else if ((kv.k.bm & 1) == 0)
+            return 1;
+
+        const KVnext* const data = kv.v.node;
+        const u32 count = __builtin_popcountll(kv.k.bm >> 1);
+        u64 n = 0;
+        for (u32 i = 0; i < count; ++i)
+            n += KVnext::row_size(data[i]);
+        return n;
+    }
+
+    // Helper for the set operations below: given the n rows (with bitmap bm) that should replace
+    // the inner node at row a, returns a itself if nothing changed, an empty row if n is 0,
+    // the lone row if it's a key/value pair, and otherwise a row for a fresh copy of rows
+    static const KVtype combined_node(const KVtype& a, const KVnext* const rows, const u32 n, const u64 bm)
+    {
+        if (n == 0)
+            return KVtype();
+        else if (bm == (a.k.bm >> 1))
+        {
+            bool same = true;
+            for (u32 i = 0; i < n && same; ++i)
+                same = rows[i] == a.v.node[i];
+            if (same)
+                return a;
+        }
+        if (n == 1 && (rows[0].k.bm & 1) == 0)
+            // As with removals, a lone pair takes its node's place
+            return lifted(rows[0]);
+
+        KVnext* const node = (KVnext*)A::allocate(n*sizeof(KVnext));
+        std::memcpy(node, rows, n*sizeof(KVnext));
+        return KVtype((bm << 1) | 1, node);
+    }
+
+    // Returns the row holding every pair of rows a and b (at the same position in two tries)
+    // Where a key is in both, it keeps a's key and its value becomes merge(a's key, a's value,
+    // b's value). Subtrees that are identical in a and b are reused as-is, as are rows only one
+    // side has. *cptr is increased by the number of b's keys that were not in a.
+    template <typename F>
+    static const KVtype union_rows(const KVtype& a, const KVtype& b, F& merge, u64* const cptr)
+    {
+        if (a == b || b.k.bm == 0)
+            return a;
+        else if (a.k.bm == 0)
+        {
+            *cptr += row_size(b);
+            return b;
+        }
+        else if ((b.k.bm & 1) == 0)
+        {
+            // b is a single pair; merge it into a
+            const u64 fh = b.key_hash();
+            if ((a.k.bm & 1) == 0)
+            {
+                if (*(a.k.key) == *(b.k.key))
+                {
+                    const V* const val = merge(a.k.key, a.v.val, b.v.val);
+                    return val == a.v.val ? a : KVtype(a, val);
+                }
+                (*cptr)++;
+                return new_inner_node(a.key_hash(), a.k.key, a.v.val, fh, b.k.key, b.v.val);
+            }
+
+            const KVtype ra = inner_find_row(a, fh, *(b.k.key));
+            if (ra.k.bm == 0)
+                return insert_inner(a, fh, b.k.key, b.v.val, cptr);
+            const V* const val = merge(ra.k.key, ra.v.val, b.v.val);
+            return val == ra.v.val ? a : insert_inner(a, fh, ra.k.key, val, cptr);
+        }
+        else if ((a.k.bm & 1) == 0)
+        {
+            // a is a single pair and b an inner node; all of b's other pairs are new
+            const u64 fh = a.key_hash();
+            const KVtype rb = inner_find_row(b, fh, *(a.k.key));
+            *cptr += row_size(b) - row_size(rb);
+            u64 ignored = 0;
+            if (rb.k.bm == 0 || rb.k.key == a.k.key)
+                return insert_inner(b, fh, a.k.key, rb.k.bm ? merge(a.k.key, a.v.val, rb.v.val) : a.v.val, &ignored);
+
+            // b's equal key gives way to a's, so b's pair is removed before a's goes in
+            const V* const val = merge(a.k.key, a.v.val, rb.v.val);
+            const KVtype rest = remove_inner(b, fh, a.k.key, &ignored);
+            if ((rest.k.bm & 1) == 0)
+                return new_inner_node(rest.key_hash(), rest.k.key, rest.v.val, fh, a.k.key, val);
+            return insert_inner(rest, fh, a.k.key, val, &ignored);
+        }
+
+        // Both are inner nodes; walk the union of their bitmaps
+        const KVnext* const da = a.v.node;
+        const KVnext* const db = b.v.node;
+        const u64 bma = a.k.bm >> 1;
+        const u64 bmb = b.k.bm >> 1;
+        const u64 bm = bma | bmb;
+        u64 buf[G::width*sizeof(KVnext)/sizeof(u64)];
+        KVnext* const rows = reinterpret_cast<KVnext*>(buf);
+        u32 n = 0, ia = 0, ib = 0;
+        for (u64 rest = bm; rest; rest &= rest - 1, ++n)
+        {
+            const u64 bit = rest & (0 - rest);
+            if ((bma & bit) && (bmb & bit))
+                new (rows+n) KVnext(KVnext::union_rows(da[ia++], db[ib++], merge, cptr));
+            else if (bma & bit)
+                new (rows+n) KVnext(da[ia++]);
+            else
+            {
+                *cptr += KVnext::row_size(db[ib]);
+                new (rows+n) KVnext(db[ib++]);
+            }
+        }
+
+        return combined_node(a, rows, n, bm);
+    }
+
+    // Returns the row holding only those pairs of row a whose keys are also beneath row b
+    // *cptr is decreased by the number of a's pairs dropped.
+    static const KVtype intersect_rows(const KVtype& a, const KVtype& b, u64* const cptr)
+    {
+        if (a == b || a.k.bm == 0)
+            return a;
+        else if (b.k.bm == 0)
+        {
+            *cptr -= row_size(a);
+            return KVtype();
+        }
+        else if ((b.k.bm & 1) == 0)
+        {
+            // At most b's one key survives
+            if ((a.k.bm & 1) == 0)
+            {
+                if (*(a.k.key) == *(b.k.key))
+                    return a;
+                (*cptr)--;
+                return KVtype();
+            }
+
+            const KVtype ra = inner_find_row(a, b.key_hash(), *(b.k.key));
+            *cptr -= row_size(a) - row_size(ra);
+            return ra;
+        }
+        else if ((a.k.bm & 1) == 0)
+        {
+            if (inner_find(b, a.key_hash(), *(a.k.key)))
+                return a;
+            (*cptr)--;
+            return KVtype();
+        }
+
+        // Both are inner nodes; only pieces in both bitmaps can survive
+        const KVnext* const da = a.v.node;
+        const KVnext* const db = b.v.node;
+        const u64 bma = a.k.bm >> 1;
+        const u64 bmb = b.k.bm >> 1;
+        u64 bm = 0;
+        u64 buf[G::width*sizeof(KVnext)/sizeof(u64)];
+        KVnext* const rows = reinterpret_cast<KVnext*>(buf);
+        u32 n = 0, ia = 0, ib = 0;
+        for (u64 rest = bma | bmb; rest; rest &= rest - 1)
+        {
+            const u64 bit = rest & (0 - rest);
+            if ((bma & bit) && (bmb & bit))
+            {
+                const KVnext row = KVnext::intersect_rows(da[ia++], db[ib++], cptr);
+                if (row.k.bm != 0)
+                {
+                    new (rows+(n++)) KVnext(row);
+                    bm |= bit;
+                }
+            }
+            else if (bma & bit)
+                *cptr -= KVnext::row_size(da[ia++]);
+            else
+                ++ib;
+        }
+
+        return combined_node(a, rows, n, bm);
+    }
+
+    // Returns the row holding only those pairs of row a whose keys are not beneath row b
+    // *cptr is decreased by the number of a's pairs dropped.
+    static const KVtype difference_rows(const KVtype& a, const KVtype& b, u64* const cptr)
+    {
+        if (a.k.bm == 0 || b.k.bm == 0)
+            return a;
+        else if (a == b)
+        {
+            *cptr -= row_size(a);
+            return KVtype();
+        }
+        else if ((b.k.bm & 1) == 0)
+        {
+            if ((a.k.bm & 1) == 0)
+            {
+                if (!(*(a.k.key) == *(b.k.key)))
+                    return a;
+                (*cptr)--;
+                return KVtype();
+            }
+            return remove_inner(a, b.key_hash(), b.k.key, cptr);
+        }
+        else if ((a.k.bm & 1) == 0)
+        {
+            if (!inner_find(b, a.key_hash(), *(a.k.key)))
+                return a;
+            (*cptr)--;
+            return KVtype();
+        }
+
+        // Both are inner nodes; pieces only in a survive untouched
+        const KVnext* const da = a.v.node;
+        const KVnext* const db = b.v.node;
+        const u64 bma = a.k.bm >> 1;
+        const u64 bmb = b.k.bm >> 1;
+        u64 bm = 0;
+        u64 buf[G::width*sizeof(KVnext)/sizeof(u64)];
+        KVnext* const rows = reinterpret_cast<KVnext*>(buf);
+        u32 n = 0;
+        for (u64 rest = bma; rest; rest &= rest - 1)
+        {
+            const u64 bit = rest & (0 - rest);
+            const u32 ia = __builtin_popcountll(bma & (bit - 1));
+            if (bmb & bit)
+            {
+                const u32 ib = __builtin_popcountll(bmb & (bit - 1));
+                const KVnext row = KVnext::difference_rows(da[ia], db[ib], cptr);
+                if (row.k.bm == 0)
+                    continue;
+                new (rows+(n++)) KVnext(row);
+            }
+            else
+                new (rows+(n++)) KVnext(da[ia]);
+            bm |= bit;
+        }
+
+        return combined_node(a, rows, n, bm);
+    }
+
+    // Calls f(k, v) on every key/value pair stored beneath the inner-node row kv
+    template <typename F>
+    static void for_each_inner(const KVtype& kv, F& f)
+    {
+        const KVnext* const data = kv.v.node;
+        const u32 count = __builtin_popcountll(kv.k.bm >> 1);
+        for (u32 i = 0; i < count; ++i)
+        {
+            if ((data[i].k.bm & 1) == 0)
+                f(data[i].k.key, data[i].v.val);
+            else
+                KVnext::for_each_inner(data[i], f);
+        }
+    }
+};
+
+
+// A template-specialized version of KV<K,V,d,A,G> for the lowest depth of inner nodes, d==G::bottom
+// After this we have exhausted our 64 bit hash (by default, 4 bits used by the root and 6*10 bits used by inner nodes)
+template <typename K, typename V, unsigned d, typename A, typename G>
+class KV<K,V,d,A,G,true> : public KVfingerprint<K, G::fingerprints>
+{
+    typedef CN<K,V,A> CNtype;
+    typedef KV<K,V,d,A,G,true> KVbottom;
+    typedef KVfingerprint<K, G::fingerprints> KVhash;
+    
+public:        
+    // We use two unions and the following cheap tagging scheme:
+    // when the lowest bit of Key k is 0, it's a key and a K*,V* pair (key and value),
+    // when the lowest bit of Key k is 1, it's either a bm (bitmap) in the top 63 bits with a 
+    // KVnext* v inner node pointer when d is less than G::bottom-1 or it's just a 1 and a pointer to a
+    // CN<K,V,A>* for collisions (In this case we use CN<K,V,A>*)
+    union Key
+    {
+        const u64 bm;
+        const K* const key;
+
+        Key(const K* const key) : key(key) { }
+        Key(const u64 bm) : bm(bm) { }
+    } k;
+        
+    union Val
+    {
+        const CNtype* const coll;
+        const V* const val;
+            
+        Val(const CNtype* const cn) : coll(cn) { }
+        Val(const V* const val) : val(val) { }
+    } v;
+
+    // Empty constructor
+    KV() : KVhash(0), k((u64)0), v((V*)0) { }
+
+    // Copy constructor
+    KV(const KVbottom& o) : KVhash(o), k(o.k), v(o.v) { }
+
+    // The different cases spelled out as constructors; h is key's full hash
+    KV(const u64 bm, const CNtype* const cn) : KVhash(0), k(bm), v(cn) { }
+    KV(const K* key, const V* val, const u64 h) : KVhash(h), k(key), v(val) { }
+
+    // The key/value row pair with its value replaced by val
+    KV(const KVbottom& pair, const V* val) : KVhash(pair), k(pair.k), v(val) { }
+
+    // The full hash of this key/value row's key
+    u64 key_hash() const
+    {
+        return KVhash::key_hash(k.key);
+    }
+
+    // Equality check (doesn't actually matter which types k and v are)
+    bool operator==(const KVbottom& kv) const
+    {
+        return k.bm == kv.k.bm && v.val == kv.v.val;
+    }
+
+    // kv is a row on the bottom depth db, so kv.v is a collision node
+    // The hash pieces are exhausted by now; collision nodes are searched by the full hash fh instead
+    template <typename P>
+    static const V* inner_find(const KVbottom& kv, const u64 fh, const P& key)
+    {
+        return kv.v.coll->find(fh, key);
+    }
+
+    template <typename P>
+    static const KVbottom inner_find_row(const KVbottom& kv, const u64 fh, const P& key)
+    {
+        const CNtype* const cn = kv.v.coll;
+        const u64 i = cn->index_of(fh, key);
+        return i < cn->count ? KVbottom(cn->pairs()[i].k, cn->pairs()[i].v, fh) : KVbottom();
+    }
+
+    // Returns a row for collision node cn without its pair at index i
+    // A lone remaining pair is stored directly in the row, and no pairs leave it empty
+    static const KVbottom without(const CNtype* const cn, const u64 i)
+    {
+        if (cn->count == 1)
+            return KVbottom();
+        else if (cn->count == 2)
+            return KVbottom(cn->pairs()[1-i].k, cn->pairs()[1-i].v, cn->hashes()[1-i]);
+        else
+            return KVbottom(1, cn->remove_at(i));
+    }
+    
+    // This is a helper for returning a copy of an internal node with one row replaced by kv
+    static const KVbottom* update_node(const KVbottom* old, const u32 count, const u32 i, const KVbottom& kv)
+    {
+        KVbottom* copy = (KVbottom*)A::allocate(count*sizeof(KVbottom));
+        std::memcpy(copy, old, count*sizeof(KV));
+        new (copy+i) KVbottom(kv);
+        return copy;
+    }
+        
+    // Helper returns a fresh inner node for two merged fh, k, v triples
+    static const KVbottom new_inner_node(const u64 fh0, const K* const k0, const V* const v0,
+                                         const u64 fh1, const K* const k1, const V* const v1)
+    {
+        // The hash pieces are exhausted; the collision node keeps the full hashes
+        return KVbottom(1, CNtype::make(fh1, k1, v1, fh0, k0, v0));
+    }
+    
+    // Inserts an h, k, v into an existing KV and returns a fresh KV for extended hash
+    static const KVbottom insert_inner(const KVbottom& kv, const u64 fh, const K* const key, const V* const val, u64* const cptr)
+    {
+        auto f = [val](const V* const old) { return val; };
+        return update_inner(kv, fh, key, f, cptr);
+    }
+
+    // Sets key to f(v) as for the inner depths' update_inner, returning kv itself if f(v) is v
+    template <typename F>
+    static const KVbottom update_inner(const KVbottom& kv, const u64 fh, const K* const key, F& f, u64* const cptr)
+    {
+        if (kv.k.bm & 1UL)
+        {
+            const CNtype* const cn = kv.v.coll->update(fh, key, f, cptr);
+            return cn == kv.v.coll ? kv : KVbottom(1UL, cn);
+        }
+        else
+        {
+            // Does the K* match exactly?
+            if (kv.may_match(fh) && *(kv.k.key) == *key)
+            {
+                // Just replace the value  
+                const V* const val = f(kv.v.val);
+                return val == kv.v.val ? kv : KVbottom(kv, val);
+            }
+            else
+            {
+                // We've run out of hash, merge them into a collision node
+                const V* const val = f(0);
+                if (val == 0)
+                    return kv;
+                (*cptr)++;
+                return KVbottom(1UL, CNtype::make(kv.key_hash(), kv.k.key, kv.v.val, fh, key, val));
+            }
+        }
+    }
+
+    // Removes an arbitrary key/value (setting the removed key/value to keyPtr and valPtr locations)
+    static const KVbottom removeFirst_inner(const KVbottom& kv, const K** const keyPtr, const V** const valPtr)
+    {
+        // Taking the last pair keeps the others in place
+        const CNtype* const cn = kv.v.coll;
+        *keyPtr = cn->pairs()[cn->count-1].k;
+        *valPtr = cn->pairs()[cn->count-1].v;
+        return without(cn, cn->count-1);
+    }
+
+    // Removes a key on the bottom-depth inner-node row kv (fh, key)
+    static const KVbottom remove_inner(const KVbottom& kv, const u64 fh, const K* const key, u64* const cptr)
+    {
+        // kv.k.bm & 1 != 0 is checked by caller
+        const CNtype* const cn = kv.v.coll;
+        const u64 i = cn->index_of(fh, *key);
+        if (i == cn->count) // Key was already absent within the node?
+            return kv;
+        (*cptr)--;
+        return without(cn, i);
+    }
+
+    // Rows at the bottom depth hold (immutable) collision nodes, so there are no nodes to own
+    static void own_new_node(const KVbottom& kv, hamt_edit<A>* const edit)
+    { }
+
+    // Transients just path-copy the collision node, as these stay short
+    static const KVbottom insert_inner_t(const KVbottom& kv, const u64 fh, const K* const key, const V* const val,
+                                         u64* const cptr, hamt_edit<A>* const edit, const bool may_own)
+    {
+        return insert_inner(kv, fh, key, val, cptr);
+    }
+
+    static const KVbottom remove_inner_t(const KVbottom& kv, const u64 fh, const K* const key,
+                                         u64* const cptr, hamt_edit<A>* const edit, const bool may_own)
+    {
+        return remove_inner(kv, fh, key, cptr);
+    }
+
+    // Staged pairs [lo, hi) have exhausted the hash; they become a single collision node
+    static const KVbottom build_inner(const KVstaged<K,V>* const staged, const u64 lo, const u64 hi)
+    {
+        CNtype* const cn = CNtype::make(hi - lo);
+        for (u64 j = lo; j < hi; ++j)
+            cn->set(j - lo, staged[j].h, staged[j].k, staged[j].v);
+        return KVbottom(1, cn);
+    }
+
+    // Returns how many key/value pairs are stored at row kv
+    static u64 row_size(const KVbottom& kv)
+    {
+        if (kv.k.bm == 0)
+            return 0;
+        else if ((kv.k.bm & 1) == 0)
+            return 1;
+
+        return kv.v.coll->count;
+    }
+
+    // Returns the key/value row for key (whose full hash is fh) at a bottom-depth row kv of
+    // any kind, or an empty row if key is absent
+    static const KVbottom row_find(const KVbottom& kv, const u64 fh, const K* const key)
+    {
+        if (kv.k.bm == 0)
+            return kv;
+        else if ((kv.k.bm & 1) == 0)
+            return kv.may_match(fh) && *(kv.k.key) == *key ? kv : KVbottom();
+        else
+            return inner_find_row(kv, fh, *key);
+    }
+
+    // Removes key (whose full hash is fh) from a bottom-depth row kv of any kind
+    static const KVbottom row_remove(const KVbottom& kv, const u64 fh, const K* const key, u64* const cptr)
+    {
+        if (kv.k.bm == 0)
+            return kv;
+        else if ((kv.k.bm & 1) == 0)
+        {
+            if (!kv.may_match(fh) || !(*(kv.k.key) == *key))
+                return kv;
+            (*cptr)--;
+            return KVbottom();
+        }
+        else
+            return remove_inner(kv, fh, key, cptr);
+    }
+
+    // Calls f(fh, k, v) on the pair or every pair of the collision node at a nonempty row kv,
+    // where fh is the key's full hash as the row or collision node caches it
+    template <typename F>
+    static void for_each_row(const KVbottom& kv, F& f)
+    {
+        if ((kv.k.bm & 1) == 0)
+            f(kv.key_hash(), kv.k.key, kv.v.val);
+        else
+            kv.v.coll->for_each_hashed(f);
+    }
+
+    // The set operations bottom out here, where the hash is exhausted, so they merge pairs one at a time
+    template <typename F>
+    static const KVbottom union_rows(const KVbottom& a, const KVbottom& b, F& merge, u64* const cptr)
+    {
+        if (a == b || b.k.bm == 0)
+            return a;
+        else if (a.k.bm == 0)
+        {
+            *cptr += row_size(b);
+            return b;
+        }
+
+        KVbottom r(a);
+        auto f = [&](const u64 fh, const K* const key, const V* const vb)
+            {
+                const KVbottom ra = row_find(r, fh, key);
+                if (ra.k.bm == 0)
+                    new (&r) KVbottom(insert_inner(r, fh, key, vb, cptr));
+                else
+                {
+                    const V* const val = merge(ra.k.key, ra.v.val, vb);
+                    if (val != ra.v.val)
+                        new (&r) KVbottom(insert_inner(r, fh, ra.k.key, val, cptr));
+                }
+            };
+        for_each_row(b, f);
+        return r;
+    }
+
+    static const KVbottom intersect_rows(const KVbottom& a, const KVbottom& b, u64* const cptr)
+    {
+        if (a == b || a.k.bm == 0)
+            return a;
+
+        KVbottom r(a);
+        auto f = [&](const u64 fh, const K* const key, const V* const va)
+            {
+                if (row_find(b, fh, key).k.bm == 0)
+                    new (&r) KVbottom(row_remove(r, fh, key, cptr));
+            };
+        for_each_row(a, f);
+        return r;
+    }
+
+    static const KVbottom difference_rows(const KVbottom& a, const KVbottom& b, u64* const cptr)
+    {
+        if (a.k.bm == 0 || b.k.bm == 0)
+            return a;
+        else if (a == b)
+        {
+            *cptr -= row_size(a);
+            return KVbottom();
+        }
+
+        KVbottom r(a);
+        auto f = [&](const u64 fh, const K* const key, const V* const vb)
+            {
+                new (&r) KVbottom(row_remove(r, fh, key, cptr));
+            };
+        for_each_row(b, f);
+        return r;
+    }
+
+    // Calls f(k, v) on every key/value pair in the collision node at kv
+    template <typename F>
+    static void for_each_inner(const KVbottom& kv, F& f)
+    {
+        kv.v.coll->for_each(f);
+    }
+};
+
+
+
+// A minimal work-stealing scheduler for the parallel traversals
+// Each worker pushes and pops tasks at the back of its own deque, and once that runs dry it
+// steals from the front of the others', where the oldest (and so largest) tasks wait.
+// A task counts as pending from push() until the worker that ran it calls finish(), which
+// it does only after pushing any subtasks, so no pending tasks means the work is done.
+template <typename T>
+class hamt_steal
+{
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<T> tasks;
+    };
+
+    std::vector<queue> queues;
+    std::atomic<u64> pending;
+
+public:
+    explicit hamt_steal(const u32 workers)
+        : queues(workers), pending(0)
+    { }
+
+    void push(const u32 w, const T& t)
+    {
+        pending.fetch_add(1);
+        std::lock_guard<std::mutex> guard(queues[w].lock);
+        queues[w].tasks.push_back(t);
+    }
+
+    // Takes a task for worker w, returning false once every task has finished
+    bool next(const u32 w, T* const t)
+    {
+        const u32 n = queues.size();
+        while (true)
+        {
+            for (u32 i = 0; i < n; ++i)
+            {
+                queue& q = queues[(w + i) % n];
+                std::lock_guard<std::mutex> guard(q.lock);
+                if (q.tasks.empty())
+                    continue;
+                else if (i == 0)
+                {
+                    *t = q.tasks.back();
+                    q.tasks.pop_back();
+                }
+                else
+                {
+                    *t = q.tasks.front();
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+            if (pending.load() == 0)
+                return false;
+            std::this_thread::yield();
+        }
+    }
+
+    void finish()
+    {
+        pending.fetch_sub(1);
+    }
+
+    // Calls body(w) for each worker w < workers, on the calling thread for w == 0 and on
+    // fresh threads, registered with the GC, for the rest. The calling thread is already
+    // registered, so it allows the others to register themselves (this is idempotent).
+    template <typename Body>
+    static void run(const u32 workers, Body body)
+    {
+        if (workers > 1)
+            GC_allow_register_threads();
+        std::vector<std::thread> threads;
+        for (u32 w = 1; w < workers; ++w)
+            threads.push_back(std::thread([&body, w]()
+                {
+                    gc_thread_scope gc;
+                    body(w);
+                }));
+        body(0);
+        for (u32 w = 0; w < threads.size(); ++w)
+            threads[w].join();
+    }
+};
+
+
+
+// The shape of one hamt, as reported by hamt::stats()
+// Arrays are sized for any geometry; entries past its bottom depth or root slots stay 0.
+struct hamt_stats
+{
+    // Pairs stored directly in rows at each depth (the root's rows are depth 0)
+    u64 depth_pairs[64];
+    // How many inner nodes hold each number of rows (1 to 63)
+    u64 node_popcounts[64];
+    // Pairs beneath each root slot; a good hash spreads these evenly
+    u64 root_pairs[64];
+    // Collision nodes at the bottom depth, the pairs they hold, and the longest one
+    u64 collisions;
+    u64 collision_pairs;
+    u64 longest_collision;
+    // Bytes of the root, inner nodes and collision nodes, and of the keys and values they point to
+    u64 node_bytes;
+    u64 key_bytes;
+    u64 value_bytes;
+
+    hamt_stats()
+    {
+        std::memset(this, 0, sizeof(hamt_stats));
+    }
+};
+
+
+
+
+// The header of a snapshot file, as written by hamt::save and mapped by hamt_view
+// The header is followed by 8-byte aligned blocks, each referred to by its offset from the
+// start of the file, so a snapshot can be mapped at any address. Rows are two words and keep
+// the in-memory tagging: an inner row is {bm|1, offset of its child rows}, a bottom-depth row
+// is {1, offset of a collision block}, a pair is {offset of its key, offset of its value}
+// and an empty row is {0, 0}. A collision block holds its count, then count full hashes,
+// then count {key offset, value offset} pairs. Words are in the host's byte order.
+struct hamt_snapshot_header
+{
+    char magic[8];
+    u32 version;
+    u32 root_slots;
+    u32 root_bits;
+    u32 bits;
+    u32 bottom;
+    u32 pad;
+    // The number of pairs, and the offset of the root's G::root_slots rows
+    u64 count;
+    u64 root;
+
+    template <typename G>
+    static hamt_snapshot_header make(const u64 count, const u64 root)
+    {
+        hamt_snapshot_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "HAMTSNAP", 8);
+        h.version = 1;
+        h.root_slots = G::root_slots;
+        h.root_bits = G::root_bits;
+        h.bits = G::bits;
+        h.bottom = G::bottom;
+        h.count = count;
+        h.root = root;
+        return h;
+    }
+
+    // True if this is a snapshot's header and its trie was shaped by geometry G
+    template <typename G>
+    bool matches() const
+    {
+        const hamt_snapshot_header h = make<G>(count, root);
+        return std::memcmp(this, &h, sizeof(h)) == 0;
+    }
+};
+
+// The codec for trivially copyable keys or values, which snapshots store as their bytes
+// A codec gives the type a snapshot stores in place of T (stored), how many bytes storing a
+// T takes (size) and how to write it there (write), and whether a stored one equals a probe
+// (equal). Stored values are 8-byte aligned and must not hold pointers.
+template <typename T>
+struct hamt_pod_codec
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "hamt_pod_codec stores keys and values as raw bytes; snapshots of other types need their own codec");
+
+    typedef T stored;
+
+    static u64 size(const T& t)
+    {
+        return sizeof(T);
+    }
+
+    static void write(const T& t, void* const out)
+    {
+        std::memcpy(out, &t, sizeof(T));
+    }
+
+    template <typename P>
+    static bool equal(const stored& s, const P& probe)
+    {
+        return s == probe;
+    }
+};
+
+// Appends 8-byte aligned blocks to a snapshot file, tracking their offsets
+class hamt_snapshot_writer
+{
+    FILE* const f;
+    u64 pos;
+    bool failed;
+    std::vector<u8> scratch;
+
+public:
+    explicit hamt_snapshot_writer(FILE* const f)
+        : f(f), pos(0), failed(!f), scratch()
+    { }
+
+    // Writes n bytes from p, padded to a multiple of 8, and returns the offset they start at
+    u64 put(const void* const p, const u64 n)
+    {
+        static const u8 zeros[8] = {};
+        const u64 at = pos;
+        const u64 pad = (8 - (n & 7)) & 7;
+        if (!failed)
+            failed = std::fwrite(p, 1, n, f) != n || std::fwrite(zeros, 1, pad, f) != pad;
+        pos += n + pad;
+        return at;
+    }
+
+    // Writes t as encoded by codec C and returns its offset
+    template <typename C, typename T>
+    u64 put_coded(const T& t)
+    {
+        scratch.assign(C::size(t), 0);
+        C::write(t, scratch.data());
+        return put(scratch.data(), scratch.size());
+    }
+
+    bool ok() const
+    {
+        return !failed;
+    }
+};
+
+
+
+// The content hash a hamt root keeps when its geometry has content hashes, and nothing otherwise
+// A map's content hash is the sum, over its pairs, of a mix of the key's and value's hashes,
+// so it doesn't depend on the trie's shape and a root can update it in O(1) per pair. M is
+// the hamt deriving from this; its functions are only instantiated with content hashes on.
+template <typename K, typename V, bool on>
+class hamt_content
+{
+    template <typename, typename, bool> friend class hamt_content;
+
+protected:
+    hamt_content() { }
+
+    // Sets this (fresh) root's hash from prev's, given that key (whose hash is h) now maps to
+    // val in this root, or is absent if val is 0; prev must still hold its old contents
+    template <typename M>
+    void update_content(const M* const prev, const u64 h, const K* const key, const V* const val)
+    { }
+
+    // Sets this root's hash from prev's by diffing the two maps, which costs time in
+    // proportion to their differences (see hamt::diff)
+    template <typename M>
+    void rediff_content(const M* const prev)
+    { }
+
+    // Sets this root, self, to hash by visiting every pair
+    template <typename M>
+    void sum_content(const M* const self)
+    { }
+
+    // The content hash of map m, which is O(1) only with content hashes on
+    template <typename M>
+    static u64 content_of(const M* const m)
+    {
+        u64 sum = 0;
+        m->for_each([&sum](const K* const k, const V* const v) { sum += mix(k->hash(), v->hash()); });
+        return sum;
+    }
+
+    // False only if the maps certainly differ
+    bool content_may_equal(const hamt_content<K,V,on>& o) const
+    {
+        return true;
+    }
+
+    // The hash of a single pair
+    static u64 mix(const u64 kh, const u64 vh)
+    {
+        u64 x = kh * 0x9e3779b97f4a7c15 ^ vh;
+        x ^= x >> 31;
+        x *= 0xbf58476d1ce4e5b9;
+        return x ^ (x >> 29);
+    }
+};
+
+template <typename K, typename V>
+class hamt_content<K,V,true>
+{
+    u64 sum;
+
+protected:
+    typedef hamt_content<K,V,false> plain;
+
+    hamt_content() : sum(0) { }
+
+    template <typename M>
+    void update_content(const M* const prev, const u64 h, const K* const key, const V* const val)
+    {
+        // type V must support a method u64 hash() const;
+        const V* const old = prev->find(h, *key);
+        sum = prev->sum - (old ? plain::mix(h, old->hash()) : 0) + (val ? plain::mix(h, val->hash()) : 0);
+    }
+
+    template <typename M>
+    void rediff_content(const M* const prev)
+    {
+        u64 s = prev->sum;
+        M::diff(prev, static_cast<const M*>(this),
+                [&s](const K* const k, const V* const v) { s += plain::mix(k->hash(), v->hash()); },
+                [&s](const K* const k, const V* const v) { s -= plain::mix(k->hash(), v->hash()); },
+                [&s](const K* const k, const V* const va, const V* const vb)
+                    { s += plain::mix(k->hash(), vb->hash()) - plain::mix(k->hash(), va->hash()); });
+        sum = s;
+    }
+
+    template <typename M>
+    void sum_content(const M* const self)
+    {
+        sum = plain::content_of(self);
+    }
+
+    template <typename M>
+    static u64 content_of(const M* const m)
+    {
+        return m->sum;
+    }
+
+    bool content_may_equal(const hamt_content<K,V,true>& o) const
+    {
+        return sum == o.sum;
+    }
+};
+
+
+
+template <typename K, typename V, typename A = gc_alloc, typename G = hamt_geometry>
+class hamt;
+
+template <typename K, typename V, typename A = gc_alloc, typename G = hamt_geometry>
+class transient_hamt;
+
+
+// A simple hash-array-mapped trie implementation (Bagwell 2001)
+// Garbage collected, persistent/immutable hashmaps
+template <typename K, typename V, typename A, typename G>
+class hamt : public hamt_content<K,V,G::content_hashes>
+{
+    typedef KV<K,V,0,A,G> KVtop;
+    friend class transient_hamt<K,V,A,G>;
+    
+private:
+    // We use G::root_bits of the hash for the root (up to 4 bits by default), then the
+    // following G::bits per level are used for inner nodes up to G::bottom deep (10*6 bits by default)
+    KVtop data[G::root_slots];
+    u64 count; 
+
+    // Returns a new root holding the given root rows and count, which replaces version prev
+    static const hamt<K,V,A,G>* with_rows(const KVtop* const rows, const u64 count, const hamt<K,V,A,G>* const prev)
+    {
+        hamt<K,V,A,G>* const new_root = new ((hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>))) hamt<K,V,A,G>();
+        std::memcpy(new_root->data, rows, G::root_slots*sizeof(KVtop));
+        new_root->count = count;
+        new_root->rediff_content(prev);
+        return new_root;
+    }
+
+    // Calls f(k, v) for every pair beneath row, which is at the given depth
+    // Like the iterator, this views rows at every depth as KVtop.
+    template <typename F>
+    static void for_each_row(const KVtop& row, const u32 depth, F& f)
+    {
+        if (row.k.bm == 0)
+            return;
+        else if ((row.k.bm & 1) == 0)
+            f(row.k.key, row.v.val);
+        else if (depth == G::bottom)
+            // Rows at the bottom depth point to collision nodes
+            reinterpret_cast<const CN<K,V,A>*>(row.v.node)->for_each(f);
+        else
+        {
+            const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+            const u32 count = __builtin_popcountll(row.k.bm >> 1);
+            for (u32 i = 0; i < count; ++i)
+                for_each_row(node[i], depth+1, f);
+        }
+    }
+
+    // As for_each_row, but calls f(h, k, v) with each key's full hash h, taken from the
+    // collision node or (with fingerprints) the row that caches it
+    template <typename F>
+    static void for_each_row_hashed(const KVtop& row, const u32 depth, F& f)
+    {
+        if (row.k.bm == 0)
+            return;
+        else if ((row.k.bm & 1) == 0)
+            f(row.key_hash(), row.k.key, row.v.val);
+        else if (depth == G::bottom)
+            reinterpret_cast<const CN<K,V,A>*>(row.v.node)->for_each_hashed(f);
+        else
+        {
+            const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+            const u32 count = __builtin_popcountll(row.k.bm >> 1);
+            for (u32 i = 0; i < count; ++i)
+                for_each_row_hashed(node[i], depth+1, f);
+        }
+    }
+
+    // Runs visitors[w](k, v) for every pair, on worker w of a pool of the given size
+    // The rows above the depth where a row is expected to hold fewer than grain pairs are
+    // split into one task per child; rows at that depth are visited sequentially.
+    template <typename F>
+    void parallel_visit(F* const visitors, const u32 workers, const u64 grain) const
+    {
+        // A row at depth d holds about count / (root_slots * width^d) pairs for a well-spread hash
+        u32 cutoff = 0;
+        for (u64 est = count / G::root_slots; est > grain && cutoff < G::bottom; est /= G::width)
+            ++cutoff;
+
+        struct task
+        {
+            const KVtop* row;
+            u32 depth;
+        };
+
+        hamt_steal<task> sched(workers);
+        for (u32 i = 0; i < G::root_slots; ++i)
+            sched.push(i % workers, task{&this->data[i], 0});
+
+        hamt_steal<task>::run(workers, [&](const u32 w)
+            {
+                task t;
+                while (sched.next(w, &t))
+                {
+                    const KVtop& row = *t.row;
+                    if (t.depth < cutoff && (row.k.bm & 1) && t.depth < G::bottom)
+                    {
+                        const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+                        const u32 n = __builtin_popcountll(row.k.bm >> 1);
+                        for (u32 i = 0; i < n; ++i)
+                            sched.push(w, task{node+i, t.depth+1});
+                    }
+                    else
+                        for_each_row(row, t.depth, visitors[w]);
+                    sched.finish();
+                }
+            });
+    }
+
+    // Adds the shape of the subtree beneath row (at the given depth) to st
+    static void stats_row(const KVtop& row, const u32 depth, hamt_stats* const st)
+    {
+        if (row.k.bm == 0)
+            return;
+        else if ((row.k.bm & 1) == 0)
+            st->depth_pairs[depth]++;
+        else if (depth == G::bottom)
+        {
+            const CN<K,V,A>* const cn = reinterpret_cast<const CN<K,V,A>*>(row.v.node);
+            st->collisions++;
+            st->collision_pairs += cn->count;
+            st->longest_collision = std::max(st->longest_collision, cn->count);
+            st->node_bytes += CN<K,V,A>::bytes(cn->count);
+        }
+        else
+        {
+            const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+            const u32 count = __builtin_popcountll(row.k.bm >> 1);
+            st->node_popcounts[count]++;
+            st->node_bytes += count*sizeof(KVtop);
+            for (u32 i = 0; i < count; ++i)
+                stats_row(node[i], depth+1, st);
+        }
+    }
+
+    static u64 aligned(const u64 n, const u64 align)
+    {
+        return (n + align - 1) & ~(align - 1);
+    }
+
+    // Returns the bytes compact() needs for the nodes beneath row (at the given depth)
+    static u64 compact_bytes(const KVtop& row, const u32 depth, const u64 align)
+    {
+        if ((row.k.bm & 1) == 0)
+            return 0;
+        else if (depth == G::bottom)
+            return aligned(CN<K,V,A>::bytes(reinterpret_cast<const CN<K,V,A>*>(row.v.node)->count), align);
+
+        const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+        const u32 count = __builtin_popcountll(row.k.bm >> 1);
+        u64 n = aligned(count*sizeof(KVtop), align);
+        for (u32 i = 0; i < count; ++i)
+            n += compact_bytes(node[i], depth+1, align);
+        return n;
+    }
+
+    // Copies the key and value of pair into block at *at, advancing *at past them
+    static void compact_pair(KVtop* const pair, u8* const block, u64* const at, const u64 align)
+    {
+        const KVtop row(*pair);
+        const K* const k = new (block + *at) K(*(row.k.key));
+        *at += aligned(sizeof(K), align);
+        const V* const v = new (block + *at) V(*(row.v.val));
+        *at += aligned(sizeof(V), align);
+        new (pair) KVtop(row, k, v);
+    }
+
+    // Lays out the count rows at rows (at the given depth), which compact() has just copied
+    // into block: pairs are copied right after them when requested, and rows referring to
+    // nodes are queued so that nodes are laid out breadth-first
+    static void compact_rows(KVtop* const rows, const u32 count, const u32 depth, u8* const block, u64* const at,
+                             const u64 align, const bool pairs, std::deque<std::pair<KVtop*, u32> >* const queue)
+    {
+        for (u32 i = 0; i < count; ++i)
+            if ((rows[i].k.bm & 1) != 0)
+                queue->push_back(std::make_pair(rows+i, depth));
+            else if (rows[i].k.bm != 0 && pairs)
+                compact_pair(rows+i, block, at, align);
+    }
+
+    // Returns the bytes of the nodes beneath row (at the given depth)
+    static u64 row_bytes(const KVtop& row, const u32 depth)
+    {
+        if ((row.k.bm & 1) == 0)
+            return 0;
+        else if (depth == G::bottom)
+            return CN<K,V,A>::bytes(reinterpret_cast<const CN<K,V,A>*>(row.v.node)->count);
+
+        const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+        const u32 count = __builtin_popcountll(row.k.bm >> 1);
+        u64 n = count*sizeof(KVtop);
+        for (u32 i = 0; i < count; ++i)
+            n += row_bytes(node[i], depth+1);
+        return n;
+    }
+
+    // Returns the bytes of nodes beneath row a that are also beneath row b, which sits at the
+    // same position in another version. Versions only share nodes at the same position, and a
+    // shared node shares everything beneath it, so only the differing paths are walked.
+    static u64 shared_row(const KVtop& a, const KVtop& b, const u32 depth)
+    {
+        if ((a.k.bm & 1) == 0 || (b.k.bm & 1) == 0)
+            return 0;
+        else if (a.v.node == b.v.node)
+            return row_bytes(a, depth);
+        else if (depth == G::bottom)
+            return 0;
+
+        const KVtop* const na = reinterpret_cast<const KVtop*>(a.v.node);
+        const KVtop* const nb = reinterpret_cast<const KVtop*>(b.v.node);
+        const u64 bma = a.k.bm >> 1;
+        const u64 bmb = b.k.bm >> 1;
+        u64 n = 0;
+        for (u64 both = bma & bmb; both; both &= both - 1)
+        {
+            const u64 bit = both & (0 - both);
+            n += shared_row(na[__builtin_popcountll(bma & (bit - 1))], nb[__builtin_popcountll(bmb & (bit - 1))], depth+1);
+        }
+        return n;
+    }
+
+    // Sets key (whose hash is h) to f(v), where v is its value or 0, and returns the new version,
+    // or this one if f(v) is v; f must not return 0 for a key that is present
+    template <typename F>
+    const hamt<K,V,A,G>* update_at(const u64 h, const K* const key, F& f) const
+    {
+        const u64 hpiece = G::root_piece(h);
+        const KVtop& row = this->data[hpiece];
+        const V* set = 0;
+        auto g = [&f, &set](const V* const old) { return set = f(old); };
+        u64 newcount = count;
+        const KVtop kv = update_row(row, h, key, g, &newcount);
+        if (kv == row)
+            return this;
+
+        hamt<K,V,A,G>* new_root = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+        std::memcpy(new_root, this, sizeof(hamt<K,V,A,G>));
+        new_root->update_content(this, h, key, set);
+        new (&new_root->data[hpiece]) KVtop(kv);
+        new_root->count = newcount;
+        return new_root;
+    }
+
+    // Returns row with key set to f(v), as for update_at, or row itself if f(v) is v
+    // R is KVtop for a root row, and otherwise the row type of the depth row is at.
+    template <typename R, typename F>
+    static const R update_row(const R& row, const u64 h, const K* const key, F& f, u64* const cptr)
+    {
+        if (row.k.bm == 0)
+        {
+            // the node has an empty bucket here
+            const V* const val = f(0);
+            if (val == 0)
+                return row;
+            (*cptr)++;
+            return R(key,val,h);
+        }
+        else if ((row.k.bm & 1) == 0)
+        {
+            // the node already has a key/value pair here
+            if (row.may_match(h) && *(row.k.key) == *key)
+            {
+                const V* const val = f(row.v.val);
+                return val == row.v.val ? row : R(key,val,h);
+            }
+            const V* const val = f(0);
+            if (val == 0)
+                return row;
+            (*cptr)++;
+            return R::new_inner_node(row.key_hash(), row.k.key, row.v.val, h, key, val);
+        }
+        else
+            // the node has an inner node here
+            return R::update_inner(row, h, key, f, cptr);
+    }
+
+    // Returns the value for key (whose full hash is h) beneath row (at the given depth), or 0
+    // if it's absent
+    static const V* find_row(const KVtop& row, const u32 depth, const u64 h, const K* const key)
+    {
+        const KVtop* r = &row;
+        for (u32 t = depth; ; ++t)
+        {
+            if (r->k.bm == 0)
+                return 0;
+            else if ((r->k.bm & 1) == 0)
+                return r->may_match(h) && *(r->k.key) == *key ? r->v.val : 0;
+            else if (t == G::bottom)
+                return reinterpret_cast<const CN<K,V,A>*>(r->v.node)->find(h, *key);
+
+            const u64 bm = r->k.bm >> 1;
+            const u32 hpiece = G::piece(h >> (G::root_bits + G::bits*t));
+            if (!(bm & (1UL << hpiece)))
+                return 0;
+            r = reinterpret_cast<const KVtop*>(r->v.node) + __builtin_popcountll((bm << 1) << (63 - hpiece));
+        }
+    }
+
+    // Reports the differences between rows a and b, which sit at the same position in two versions
+    // Where both are inner nodes, only the children that differ are visited; otherwise one
+    // side is a single pair or a collision node, and the pairs of each are looked up in the other.
+    template <typename FA, typename FR, typename FC>
+    static void diff_row(const KVtop& a, const KVtop& b, const u32 depth, FA& added, FR& removed, FC& changed)
+    {
+        if (a == b)
+            return;
+        else if (a.k.bm == 0)
+            for_each_row(b, depth, added);
+        else if (b.k.bm == 0)
+            for_each_row(a, depth, removed);
+        else if ((a.k.bm & 1) == 0 || (b.k.bm & 1) == 0 || depth == G::bottom)
+        {
+            auto froma = [&](const u64 h, const K* const k, const V* const va)
+                {
+                    const V* const vb = find_row(b, depth, h, k);
+                    if (vb == 0)
+                        removed(k, va);
+                    else if (vb != va)
+                        changed(k, va, vb);
+                };
+            auto fromb = [&](const u64 h, const K* const k, const V* const vb)
+                {
+                    if (find_row(a, depth, h, k) == 0)
+                        added(k, vb);
+                };
+            for_each_row_hashed(a, depth, froma);
+            for_each_row_hashed(b, depth, fromb);
+        }
+        else
+        {
+            const KVtop* const na = reinterpret_cast<const KVtop*>(a.v.node);
+            const KVtop* const nb = reinterpret_cast<const KVtop*>(b.v.node);
+            const u64 bma = a.k.bm >> 1;
+            const u64 bmb = b.k.bm >> 1;
+            u32 ia = 0, ib = 0;
+            for (u64 rest = bma | bmb; rest; rest &= rest - 1)
+            {
+                const u64 bit = rest & (0 - rest);
+                if ((bma & bit) && (bmb & bit))
+                    diff_row(na[ia++], nb[ib++], depth+1, added, removed, changed);
+                else if (bma & bit)
+                    for_each_row(na[ia++], depth+1, removed);
+                else
+                    for_each_row(nb[ib++], depth+1, added);
+            }
+        }
+    }
+
+    // Returns row (at the given depth) with what it refers to replaced by the canonical equal
+    // node (see hamt_intern_table). A node already in the table is canonical, and so is
+    // everything beneath it, so only nodes built since the last intern() are visited.
+    static KVtop intern_row(const KVtop& row, const u32 depth)
+    {
+        if ((row.k.bm & 1) == 0)
+            return row;
+        else if (depth == G::bottom)
+        {
+            const CN<K,V,A>* const cn = reinterpret_cast<const CN<K,V,A>*>(row.v.node);
+            return KVtop(row.k.bm, (const KV<K,V,1,A,G>*)hamt_intern_table::intern(cn, CN<K,V,A>::bytes(cn->count)));
+        }
+
+        const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+        const u32 count = __builtin_popcountll(row.k.bm >> 1);
+        const u64 bytes = count*sizeof(KVtop);
+        if (const void* const canonical = hamt_intern_table::find(node, bytes))
+            return KVtop(row.k.bm, (const KV<K,V,1,A,G>*)canonical);
+
+        // Copy the node only if some child turns out not to be canonical
+        KVtop* copy = 0;
+        for (u32 i = 0; i < count; ++i)
+        {
+            const KVtop child = intern_row(node[i], depth+1);
+            if (!copy && !(child == node[i]))
+            {
+                copy = (KVtop*)A::allocate(bytes);
+                std::memcpy(copy, node, bytes);
+            }
+            if (copy)
+                new (copy+i) KVtop(child);
+        }
+        return KVtop(row.k.bm, (const KV<K,V,1,A,G>*)hamt_intern_table::intern(copy ? copy : node, bytes));
+    }
+
+    // Writes what row refers to (at the given depth) to a snapshot, and sets out to the
+    // row's two words there. Children are written before the rows that refer to them.
+    template <typename KC, typename VC>
+    static void save_row(hamt_snapshot_writer* const w, const KVtop& row, const u32 depth, u64* const out)
+    {
+        if (row.k.bm == 0)
+        {
+            out[0] = 0;
+            out[1] = 0;
+        }
+        else if ((row.k.bm & 1) == 0)
+        {
+            out[0] = w->put_coded<KC>(*(row.k.key));
+            out[1] = w->put_coded<VC>(*(row.v.val));
+        }
+        else if (depth == G::bottom)
+        {
+            const CN<K,V,A>* const cn = reinterpret_cast<const CN<K,V,A>*>(row.v.node);
+            std::vector<u64> block(1 + 3*cn->count);
+            block[0] = cn->count;
+            for (u64 i = 0; i < cn->count; ++i)
+            {
+                block[1+i] = cn->hashes()[i];
+                block[1+cn->count+2*i] = w->put_coded<KC>(*(cn->pairs()[i].k));
+                block[2+cn->count+2*i] = w->put_coded<VC>(*(cn->pairs()[i].v));
+            }
+            out[0] = 1;
+            out[1] = w->put(block.data(), block.size()*sizeof(u64));
+        }
+        else
+        {
+            const KVtop* const node = reinterpret_cast<const KVtop*>(row.v.node);
+            const u32 count = __builtin_popcountll(row.k.bm >> 1);
+            u64 rows[2*G::width];
+            for (u32 i = 0; i < count; ++i)
+                save_row<KC,VC>(w, node[i], depth+1, rows+2*i);
+            out[0] = row.k.bm;
+            out[1] = w->put(rows, count*2*sizeof(u64));
+        }
+    }
+
+    static u32 default_workers(const u32 workers)
+    {
+        if (workers)
+            return workers;
+        const u32 n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    // Packs every hash piece of h into a staged pair's path (see KVstaged)
+    static u64 staged_path(const u64 h)
+    {
+        u64 path = (u64)G::root_piece(h) << (64 - G::root_bits);
+        for (u32 d = 0; d < G::bottom; ++d)
+            path |= (u64)G::piece(h >> (G::root_bits + G::bits*d)) << (64 - G::root_bits - G::bits*(d+1));
+        return path;
+    }
+
+    // Sorts n staged pairs by path, keeping pairs with equal paths in order, and then keeps
+    // one pair per key, arranged as inserting them in order would leave them: a collision node
+    // lists keys as they arrived, except that the second precedes the first, and keeps each
+    // key's first K* with its last value; a lone pair takes the K* of the last pair for its key
+    // (unless that pair left the value unchanged). Returns how many pairs remain.
+    static u64 sort_staged(KVstaged<K,V>* const staged, const u64 n)
+    {
+        std::stable_sort(staged, staged+n);
+
+        // Equal keys have equal paths, so only pairs within a run of equal paths need to be compared
+        u64 unique = 0;
+        for (u64 lo = 0; lo < n; )
+        {
+            u64 hi = lo+1;
+            while (hi < n && staged[hi].path == staged[lo].path)
+                ++hi;
+            const u64 first = unique;
+            for (u64 a = lo; a < hi; ++a)
+            {
+                u64 u = first;
+                while (u < unique && !(*(staged[u].k) == *(staged[a].k)))
+                    ++u;
+                if (u == unique)
+                {
+                    staged[unique++] = staged[a];
+                    if (unique - first == 2)
+                        std::swap(staged[first], staged[first+1]);
+                }
+                else if (staged[u].v != staged[a].v && unique - first == 1)
+                    staged[u] = staged[a];
+                else
+                    staged[u].v = staged[a].v;
+            }
+            lo = hi;
+        }
+        return unique;
+    }
+
+    // Inserts the n pairs starting at begin for parallel_insert_all
+    // A bucket is a root slot and a row of its node. Each worker hashes a contiguous chunk of
+    // the pairs and counts them per bucket; the chunks are then scattered into buckets in their
+    // original order. A root slot this map leaves empty is built from scratch, bottom-up,
+    // after sorting each of its buckets; so is one holding a single pair, which is staged
+    // ahead of the range as if inserted first. Beneath a root slot holding a node, each
+    // bucket's pairs are inserted into this map's row for it, in order.
+    template <typename It>
+    const hamt<K,V,A,G>* parallel_insert(It begin, const u64 n, const u32 workers) const
+    {
+        typedef KVstaged<K,V> staged_t;
+        typedef KV<K,V,1,A,G> KVchild;
+        const u32 split = 64 - G::root_bits - G::bits;
+        const u64 buckets = 1UL << (G::root_bits + G::bits);
+        const u64 rowmask = (1UL << G::bits) - 1;
+
+        u64 m = n;
+        for (u32 r = 0; r < G::root_slots; ++r)
+            if (this->data[r].k.bm != 0 && (this->data[r].k.bm & 1) == 0)
+                ++m;
+        staged_t* const staged = (staged_t*)A::allocate(m*sizeof(staged_t));
+        staged_t* const parted = (staged_t*)A::allocate(m*sizeof(staged_t));
+        u64 j = 0;
+        for (u32 r = 0; r < G::root_slots; ++r)
+            if (this->data[r].k.bm != 0 && (this->data[r].k.bm & 1) == 0)
+            {
+                staged[j].k = this->data[r].k.key;
+                staged[j++].v = this->data[r].v.val;
+            }
+        const u64 restaged = j;
+        for (It it = begin; j < m; ++it, ++j)
+        {
+            staged[j].k = it->first;
+            staged[j].v = it->second;
+        }
+
+        const u64 chunk = (m + workers - 1) / workers;
+        std::vector<u64> at(workers*buckets, 0);
+        hamt_steal<u64>::run(workers, [&](const u32 w)
+            {
+                u64* const counts = &at[w*buckets];
+                for (u64 i = w*chunk; i < m && i < (w+1)*chunk; ++i)
+                {
+                    // type K must support a method u64 hash() const;
+                    staged[i].h = staged[i].k->hash();
+                    staged[i].path = staged_path(staged[i].h);
+                    ++counts[staged[i].path >> split];
+                }
+            });
+
+        // Bucket b holds parted[start[b], start[b+1]), with worker w's pairs after those of workers before it
+        std::vector<u64> start(buckets+1, 0);
+        for (u64 b = 0, offset = 0; b < buckets; ++b)
+        {
+            start[b] = offset;
+            for (u32 w = 0; w < workers; ++w)
+            {
+                const u64 c = at[w*buckets + b];
+                at[w*buckets + b] = offset;
+                offset += c;
+            }
+        }
+        start[buckets] = m;
+        hamt_steal<u64>::run(workers, [&](const u32 w)
+            {
+                u64* const offsets = &at[w*buckets];
+                for (u64 i = w*chunk; i < m && i < (w+1)*chunk; ++i)
+                    parted[offsets[staged[i].path >> split]++] = staged[i];
+            });
+
+        // unique[b] is how many pairs a bucket built from scratch keeps
+        hamt_steal<u64> sched(workers);
+        std::vector<u64> unique(buckets, 0);
+        for (u64 b = 0; b < buckets; ++b)
+            if (start[b+1] > start[b] && (this->data[b >> G::bits].k.bm & 1) == 0)
+                sched.push(b % workers, b);
+        hamt_steal<u64>::run(workers, [&](const u32 w)
+            {
+                u64 b;
+                while (sched.next(w, &b))
+                {
+                    unique[b] = sort_staged(parted + start[b], start[b+1] - start[b]);
+                    sched.finish();
+                }
+            });
+
+        // A root slot left with one pair keeps it in its row; otherwise its node has a row per
+        // non-empty bucket, which is this map's row when the bucket has no pairs and is
+        // otherwise filled in by a worker
+        hamt<K,V,A,G>* const h = new ((hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>))) hamt<K,V,A,G>();
+        h->count = count - restaged;
+        std::vector<KVchild*> rows(buckets, (KVchild*)0);
+        for (u32 r = 0; r < G::root_slots; ++r)
+        {
+            const u64 first = (u64)r << G::bits;
+            const KVtop& row = this->data[r];
+            if (row.k.bm & 1)
+            {
+                const u64 had = row.k.bm >> 1;
+                u64 bm = had;
+                for (u64 b = first; b <= (first | rowmask); ++b)
+                    if (start[b+1] > start[b])
+                        bm |= 1UL << (b & rowmask);
+                KVchild* const node = (KVchild*)A::allocate(__builtin_popcountll(bm)*sizeof(KVchild));
+                const KVchild* const old = reinterpret_cast<const KVchild*>(row.v.node);
+                new (&h->data[r]) KVtop((bm << 1) | 1, node);
+                for (u32 i = 0; bm; bm &= bm - 1, ++i)
+                {
+                    const u64 bit = bm & (0 - bm);
+                    const u64 b = first + __builtin_ctzll(bm);
+                    new (node+i) KVchild((had & bit) ? old[__builtin_popcountll(had & (bit - 1))] : KVchild());
+                    if (start[b+1] > start[b])
+                    {
+                        rows[b] = node+i;
+                        sched.push(b % workers, b);
+                    }
+                }
+                continue;
+            }
+
+            u64 bm = 0, total = 0;
+            for (u64 b = first; b <= (first | rowmask); ++b)
+                if (unique[b])
+                {
+                    bm |= 1UL << (b & rowmask);
+                    total += unique[b];
+                }
+            h->count += total;
+            if (total == 1)
+            {
+                const staged_t& s = parted[start[first + __builtin_ctzll(bm)]];
+                new (&h->data[r]) KVtop(s.k, s.v, s.h);
+            }
+            else if (total > 1)
+            {
+                KVchild* const node = (KVchild*)A::allocate(__builtin_popcountll(bm)*sizeof(KVchild));
+                new (&h->data[r]) KVtop((bm << 1) | 1, node);
+                for (u32 i = 0; bm; bm &= bm - 1, ++i)
+                {
+                    const u64 b = first + __builtin_ctzll(bm);
+                    rows[b] = node+i;
+                    sched.push(b % workers, b);
+                }
+            }
+        }
+
+        // Other allocators keep per-thread state that must not outlive the calling thread
+        const bool shared = std::is_same<A, gc_alloc>::value || std::is_same<A, malloc_alloc>::value;
+        std::vector<u64> added(buckets, 0);
+        hamt_steal<u64>::run(shared ? workers : 1, [&](const u32 w)
+            {
+                u64 b;
+                while (sched.next(w, &b))
+                {
+                    const staged_t* const s = parted + start[b];
+                    if (this->data[b >> G::bits].k.bm & 1)
+                    {
+                        for (u64 i = 0; i < start[b+1] - start[b]; ++i)
+                        {
+                            const V* const val = s[i].v;
+                            auto f = [val](const V* const old) { return val; };
+                            const KVchild kv = update_row(*rows[b], s[i].h, s[i].k, f, &added[b]);
+                            new (rows[b]) KVchild(kv);
+                        }
+                    }
+                    else if (unique[b] == 1)
+                        new (rows[b]) KVchild(s->k, s->v, s->h);
+                    else
+                        new (rows[b]) KVchild(KVchild::build_inner(s, 0, unique[b]));
+                    sched.finish();
+                }
+            });
+        for (u64 b = 0; b < buckets; ++b)
+            h->count += added[b];
+        if (count == 0)
+            h->sum_content(h);
+        else
+            h->rediff_content(this);
+
+        A::deallocate(parted, m*sizeof(staged_t));
+        A::deallocate(staged, m*sizeof(staged_t));
+        return h;
+    }
+
+    // One worker's running total for parallel_reduce; padded so totals don't share a cache line
+    template <typename R, typename M, typename C>
+    struct reducer
+    {
+        R acc;
+        M* map;
+        C* combine;
+        u8 pad[64];
+
+        reducer(const R& identity, M* map, C* combine)
+            : acc(identity), map(map), combine(combine)
+        { }
+
+        void operator()(const K* const k, const V* const v)
+        {
+            acc = (*combine)(acc, (*map)(k, v));
+        }
+    };
+
+public:
+    hamt<K,V,A,G>()
+        : data{}, count(0)
+    { }
+    
+    const V* get(const K* const key) const
+    {
+        // type K must support a method u64 hash() const; 
+        return find(key->hash(), *key);
+    }
+
+    // Looks up a key that needn't live on the heap, such as one on the stack
+    const V* get(const K& key) const
+    {
+        return find(key.hash(), key);
+    }
+
+    // Looks up key given its hash h, which must equal key.hash()
+    const V* get(const u64 h, const K& key) const
+    {
+        return find(h, key);
+    }
+
+    // Looks up the key equal to probe, which may be of any type P with a u64 hash() const giving
+    // the same hash as the key it stands for, and a bool operator==(const K&, const P&)
+    // (e.g., a lightweight view of a string key). No K is ever constructed.
+    template <typename P>
+    const V* find(const P& probe) const
+    {
+        return find(probe.hash(), probe);
+    }
+
+    // As above, with the probe's hash h already computed
+    template <typename P>
+    const V* find(const u64 h, const P& probe) const
+    {
+        const u64 hpiece = G::root_piece(h);
+ 
+        if (this->data[hpiece].k.bm == 0)
+            // It's a zero, return null for failure
+            return 0;
+        else if ((this->data[hpiece].k.bm & 1) == 0)
+        {
+            // It's a key/value pair, check for equality
+            if (this->data[hpiece].may_match(h) && *(this->data[hpiece].k.key) == probe)
+            {
+                return this->data[hpiece].v.val;
+            }
+            else
+                return 0;
+        }
+        else
+            // It's an inner node
+            return KVtop::inner_find(this->data[hpiece], h, probe);
+    }
+
+    // Looks up n keys at once, setting out[j] to the value for keys[j] (or 0 if absent)
+    // A single get is a chain of dependent loads, one per depth, so a stream of them is bound by
+    // memory latency. Here keys are taken in groups that advance together one load at a
+    // time: each pass prefetches the next row (or key) of every lookup in the group before
+    // any of them is touched, so their cache misses overlap. As in the iterator, rows at every
+    // depth are viewed as KVtop, and depth tells us how to read them.
+    void get_many(const K* const* const keys, const u64 n, const V** const out) const
+    {
+        typedef CN<K,V,A> CNtype;
+        const u32 group = 16;
+
+        // For each lookup: the row it has reached, its depth, its full hash and what's left of it;
+        // leaf is set once that row is a pair whose key is being fetched for comparison
+        const KVtop* row[group];
+        u32 depth[group];
+        u64 fh[group];
+        u64 h[group];
+        bool leaf[group];
+
+        for (u64 base = 0; base < n; base += group)
+        {
+            const u32 m = (u32)std::min((u64)group, n - base);
+            for (u32 j = 0; base+m+j < n && j < group; ++j)
+                // The next group's keys are hashed as soon as it starts
+                __builtin_prefetch(keys[base+m+j]);
+            for (u32 j = 0; j < m; ++j)
+            {
+                // type K must support a method u64 hash() const;
+                const u64 hj = keys[base+j]->hash();
+                row[j] = &this->data[G::root_piece(hj)];
+                depth[j] = 0;
+                fh[j] = hj;
+                h[j] = hj >> G::root_bits;
+                leaf[j] = false;
+            }
+
+            for (u32 active = m; active > 0; )
+            {
+                active = 0;
+                for (u32 j = 0; j < m; ++j)
+                {
+                    if (!row[j])
+                        continue;
+
+                    const KVtop& r = *row[j];
+                    if (leaf[j])
+                    {
+                        // The key was prefetched on the last pass
+                        out[base+j] = *(r.k.key) == *(keys[base+j]) ? r.v.val : 0;
+                        row[j] = 0;
+                    }
+                    else if (r.k.bm == 0)
+                    {
+                        out[base+j] = 0;
+                        row[j] = 0;
+                    }
+                    else if ((r.k.bm & 1) == 0)
+                    {
+                        if (!r.may_match(fh[j]))
+                        {
+                            // A fingerprint rules the key out without fetching it
+                            out[base+j] = 0;
+                            row[j] = 0;
+                            continue;
+                        }
+                        __builtin_prefetch(r.k.key);
+                        leaf[j] = true;
+                        ++active;
+                    }
+                    else if (depth[j] == G::bottom)
+                    {
+                        // Rows at the bottom depth point to collision nodes
+                        const CNtype* const cn = reinterpret_cast<const CNtype*>(r.v.node);
+                        const u64 i = cn->index_of(fh[j], *(keys[base+j]));
+                        out[base+j] = i < cn->count ? cn->pairs()[i].v : 0;
+                        row[j] = 0;
+                    }
+                    else
+                    {
+                        const u64 bm = r.k.bm >> 1;
+                        const u32 hpiece = G::piece(h[j]);
+                        if (bm & (1UL << hpiece))
+                        {
+                            const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
+                            row[j] = reinterpret_cast<const KVtop*>(r.v.node) + i;
+                            __builtin_prefetch(row[j]);
+                            ++depth[j];
+                            h[j] >>= G::bits;
+                            ++active;
+                        }
+                        else
+                        {
+                            out[base+j] = 0;
+                            row[j] = 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    const hamt<K,V,A,G>* insert(const K* const key, const V* const val) const
+    {
+        // type K must support a method u64 hash() const; 
+        return insert(key->hash(), key, val);
+    }
+
+    // Inserts key given its hash h, which must equal key->hash()
+    // Returns this map itself if key already maps to val.
+    const hamt<K,V,A,G>* insert(const u64 h, const K* const key, const V* const val) const
+    {
+        auto f = [val](const V* const old) { return val; };
+        return update_at(h, key, f);
+    }
+
+    // Inserts key unless it's already present, in which case this map itself is returned
+    const hamt<K,V,A,G>* insert_if_absent(const K* const key, const V* const val) const
+    {
+        // type K must support a method u64 hash() const;
+        return insert_if_absent(key->hash(), key, val);
+    }
+
+    const hamt<K,V,A,G>* insert_if_absent(const u64 h, const K* const key, const V* const val) const
+    {
+        auto f = [val](const V* const old) { return old ? old : val; };
+        return update_at(h, key, f);
+    }
+
+    // Maps key to f(v) in a single traversal, where v is key's current value or 0 if it's
+    // absent; f returning 0 leaves key absent (removing it if present). Returns this map
+    // itself, allocating nothing, if f(v) is v.
+    template <typename F>
+    const hamt<K,V,A,G>* update(const K* const key, F f) const
+    {
+        // type K must support a method u64 hash() const;
+        return update(key->hash(), key, f);
+    }
+
+    template <typename F>
+    const hamt<K,V,A,G>* update(const u64 h, const K* const key, F f) const
+    {
+        // A removal takes a second traversal, through remove
+        bool removing = false;
+        auto g = [&f, &removing](const V* const old)
+            {
+                const V* const val = f(old);
+                removing = val == 0 && old != 0;
+                return removing ? old : val;
+            };
+        const hamt<K,V,A,G>* const r = update_at(h, key, g);
+        return removing ? remove(h, *key) : r;
+    }
+    
+    const hamt<K,V,A,G>* removeFirst(const K** const keyPtr, const V** const valPtr) const
+    {
+        for (u64 i = 0; i < G::root_slots; ++i)
+        {
+            if ((this->data[i].k.bm & 1) == 1)
+            {
+                const KVtop kv = KVtop::removeFirst_inner(this->data[i], keyPtr, valPtr);
+                hamt<K,V,A,G>* new_root = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+                std::memcpy(new_root, this, sizeof(hamt<K,V,A,G>));
+                new_root->update_content(this, (*keyPtr)->hash(), *keyPtr, 0);
+                new (&new_root->data[i]) KVtop(kv);
+                new_root->count = this->count - 1;
+                return new_root;
+            }
+            else if (this->data[i].k.bm != 0)
+            { 
+                *keyPtr = this->data[i].k.key;
+                *valPtr = this->data[i].v.val;
+                return this->remove(*keyPtr);
+            }
+        }
+
+        return this;
+    }
+
+    const hamt<K,V,A,G>* remove(const K* const key) const
+    {
+        // type K must support a method u64 hash() const; 
+        return remove(key->hash(), *key);
+    }
+
+    // Removes a key that needn't live on the heap
+    const hamt<K,V,A,G>* remove(const K& key) const
+    {
+        return remove(key.hash(), key);
+    }
+
+    // Removes key given its hash h, which must equal key.hash()
+    const hamt<K,V,A,G>* remove(const u64 h, const K& key) const
+    {
+        const u64 hpiece = G::root_piece(h);
+
+        if (this->data[hpiece].k.bm == 0)
+            return this;
+        else if ((this->data[hpiece].k.bm & 1) == 0)
+        { 
+            // the root node already has a key/value pair at hpiece
+            // (we turn on the lowest bit to indicate when it is not a K*)
+            if (this->data[hpiece].may_match(h) && *(this->data[hpiece].k.key) == key)
+            { 
+                hamt<K,V,A,G>* new_root = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+                std::memcpy(new_root, this, sizeof(hamt<K,V,A,G>));
+                new_root->update_content(this, h, &key, 0);
+                new (&(new_root->data[hpiece])) KVtop();
+                --(new_root->count);
+                return new_root;
+            }
+            else
+                return this;
+        }
+        else
+        {
+            // Try a remove_inner and see what comes back
+            u64 temp_count = this->count;
+            const KVtop kv = KVtop::remove_inner(this->data[hpiece], h, &key, &temp_count);
+            if (kv == this->data[hpiece])
+                return this;
+            else
+            {
+                // We got back a new inner node and need to produce a new root
+                hamt<K,V,A,G>* new_root = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+                std::memcpy(new_root, this, sizeof(hamt<K,V,A,G>));
+                new_root->update_content(this, h, &key, 0);
+                new (&new_root->data[hpiece]) KVtop(kv);
+                new_root->count = temp_count;
+                return new_root;
+            }
+        }
+    }
+
+    u64 size() const
+    {
+        return count;
+    }
+
+    // An order-independent hash of this map's pairs; keys and values must support u64 hash() const
+    // This is O(1) with content hashes (see hamt_content_hashes), and a full traversal otherwise.
+    u64 hash() const
+    {
+        return hamt::content_of(this);
+    }
+
+    // True if both maps hold equal keys mapped to equal values (by K's and V's operator==)
+    // Maps of different sizes or content hashes are told apart at once; otherwise the maps are
+    // compared as by diff, so subtrees they share are skipped.
+    bool operator==(const hamt<K,V,A,G>& o) const
+    {
+        if (this == &o)
+            return true;
+        else if (count != o.count || !this->content_may_equal(o))
+            return false;
+
+        bool same = true;
+        diff(this, &o,
+             [&same](const K* const k, const V* const v) { same = false; },
+             [&same](const K* const k, const V* const v) { same = false; },
+             [&same](const K* const k, const V* const va, const V* const vb) { same = same && *va == *vb; });
+        return same;
+    }
+
+    bool operator!=(const hamt<K,V,A,G>& o) const
+    {
+        return !(*this == o);
+    }
+
+    // Builds a hamt from a range of pairs whose first is a const K* and second a const V*
+    // Rather than inserting one pair at a time, this hashes every key once, sorts the pairs
+    // by their hash path, and builds the trie bottom-up so each node is allocated exactly
+    // once. The result has the same layout repeated insert would produce; when a key
+    // appears more than once, its last pair wins, as it would for insert.
+    template <typename It>
+    static const hamt<K,V,A,G>* from_range(It begin, It end)
+    {
+        typedef KVstaged<K,V> staged_t;
+        const u64 n = std::distance(begin, end);
+        staged_t* const staged = (staged_t*)A::allocate((n ? n : 1)*sizeof(staged_t));
+        u64 j = 0;
+        for (It it = begin; it != end; ++it, ++j)
+        {
+            // type K must support a method u64 hash() const;
+            const u64 h = it->first->hash();
+            staged[j].path = staged_path(h);
+            staged[j].h = h;
+            staged[j].k = it->first;
+            staged[j].v = it->second;
+        }
+        const u64 unique = sort_staged(staged, n);
+
+        hamt<K,V,A,G>* const h = new ((hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>))) hamt<K,V,A,G>();
+        h->count = unique;
+        for (u64 lo = 0; lo < unique; )
+        {
+            const u64 hpiece = staged[lo].path >> (64 - G::root_bits);
+            u64 hi = lo+1;
+            while (hi < unique && (staged[hi].path >> (64 - G::root_bits)) == hpiece)
+                ++hi;
+
+            if (hi - lo == 1)
+                new (&h->data[hpiece]) KVtop(staged[lo].k, staged[lo].v, staged[lo].h);
+            else
+                new (&h->data[hpiece]) KVtop(KVtop::build_inner(staged, lo, hi));
+            lo = hi;
+        }
+        h->sum_content(h);
+
+        A::deallocate(staged, (n ? n : 1)*sizeof(staged_t));
+        return h;
+    }
+
+    // Returns this map with every pair of a range (as for from_range) inserted, building on
+    // workers threads (by default one per hardware thread)
+    // A key's hash alone decides its root slot and its row beneath that slot, so the pairs
+    // are partitioned on those two pieces and each partition's subtree is built (bottom-up, as
+    // in from_range, where this map has no subtree yet) by whichever worker takes it; the
+    // subtrees are then stitched into a root. The result is exactly the map inserting the
+    // pairs in order would produce, with the last pair for a key winning. Ranges of fewer than
+    // grain pairs are built on the calling thread. Worker threads register themselves with the
+    // GC, as for parallel_for_each.
+    template <typename It>
+    const hamt<K,V,A,G>* parallel_insert_all(It begin, It end, u32 workers = 0, const u64 grain = 4096) const
+    {
+        const u64 n = std::distance(begin, end);
+        if (n == 0)
+            return this;
+        workers = n < grain ? 1 : default_workers(workers);
+        return parallel_insert(begin, n, workers);
+    }
+
+    // Returns the union of this map and other; where a key is in both, the result keeps this
+    // map's key pointer and its value becomes merge(this's key, this's value, other's value), for
+    // a merge callable as const V* (const K*, const V*, const V*)
+    // Both tries are walked together, combining inner-node bitmaps, and any subtree present
+    // in only one map or identical in both is reused as-is. For two versions sharing most
+    // of their structure the cost is proportional to their difference, not their size.
+    template <typename F>
+    const hamt<K,V,A,G>* union_with(const hamt<K,V,A,G>* const other, F merge) const
+    {
+        u64 newcount = this->count;
+        KVtop rows[G::root_slots];
+        bool same = true;
+        for (u32 i = 0; i < G::root_slots; ++i)
+        {
+            new (rows+i) KVtop(KVtop::union_rows(this->data[i], other->data[i], merge, &newcount));
+            same = same && rows[i] == this->data[i];
+        }
+        return same ? this : with_rows(rows, newcount, this);
+    }
+
+    // Returns the pairs of this map whose keys are also in other
+    const hamt<K,V,A,G>* intersect(const hamt<K,V,A,G>* const other) const
+    {
+        u64 newcount = this->count;
+        KVtop rows[G::root_slots];
+        bool same = true;
+        for (u32 i = 0; i < G::root_slots; ++i)
+        {
+            new (rows+i) KVtop(KVtop::intersect_rows(this->data[i], other->data[i], &newcount));
+            same = same && rows[i] == this->data[i];
+        }
+        return same ? this : with_rows(rows, newcount, this);
+    }
+
+    // Returns the pairs of this map whose keys are not in other
+    // Subtrees shared with other are dropped whole, but their pairs must still be counted.
+    const hamt<K,V,A,G>* difference(const hamt<K,V,A,G>* const other) const
+    {
+        u64 newcount = this->count;
+        KVtop rows[G::root_slots];
+        bool same = true;
+        for (u32 i = 0; i < G::root_slots; ++i)
+        {
+            new (rows+i) KVtop(KVtop::difference_rows(this->data[i], other->data[i], &newcount));
+            same = same && rows[i] == this->data[i];
+        }
+        return same ? this : with_rows(rows, newcount, this);
+    }
+
+    // Returns a fresh transient (mutable builder) starting from this version
+    transient_hamt<K,V,A,G>* transient() const
+    {
+        return new ((transient_hamt<K,V,A,G>*)A::allocate(sizeof(transient_hamt<K,V,A,G>))) transient_hamt<K,V,A,G>(this);
+    }
+
+    // Calls f(k, v) for every key/value pair without allocating
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (u32 i = 0; i < G::root_slots; ++i)
         {
-            // This key/value is next
-            *keyPtr = data[0].k.key;
-            *valPtr = data[0].v.val;
+            if (this->data[i].k.bm == 0)
+                continue;
+            else if ((this->data[i].k.bm & 1) == 0)
+                f(this->data[i].k.key, this->data[i].v.val);
+            else
+                KVtop::for_each_inner(this->data[i], f);
         }
+    }
 
-        // If either a key/value or whole inner node was removed, shrink this inner node
-        if (count == 1)
-            return KVtype((K*)0, (V*)0);
-        else
+    // Reports the shape of this map: where its pairs sit, how full its nodes are, how its
+    // collisions look, and how many bytes it uses. This walks every node.
+    hamt_stats stats() const
+    {
+        hamt_stats st;
+        st.node_bytes = sizeof(hamt<K,V,A,G>);
+        st.key_bytes = count*sizeof(K);
+        st.value_bytes = count*sizeof(V);
+        u64 seen = 0;
+        for (u32 i = 0; i < G::root_slots; ++i)
         {
-            KVnext* const node = (KVnext*)GC_MALLOC((count-1)*sizeof(KVnext));
-            std::memcpy(node, &(data[1]), (count-1)*sizeof(KVnext));
-            // bm & (bm-1) removes the lowest-significant bit in bm
-            const u64 newbm = ((bm & (bm - 1)) << 1) | 1;
-            return KVtype(newbm, node);
+            stats_row(this->data[i], 0, &st);
+            u64 pairs = st.collision_pairs;
+            for (u32 d = 0; d <= G::bottom; ++d)
+                pairs += st.depth_pairs[d];
+            st.root_pairs[i] = pairs - seen;
+            seen = pairs;
         }
+        return st;
     }
 
-    // Removes key from kv and returns an updated KV
-    static const KVtype remove_inner(const KVtype& kv, const u64 h, const K* const key, u64* const cptr)
+    // Returns how many bytes of a's nodes b also uses (all of them, root included, if a == b)
+    static u64 shared_bytes(const hamt<K,V,A,G>* const a, const hamt<K,V,A,G>* const b)
     {
-        // We follow the same basic structure as insert_inner; first, calculate the next hash piece
-        const KVnext* const data = kv.v.node;
-        const u64 bm = kv.k.bm >> 1;
-        const u32 hpiece = (h & 0x3f) % 63;
-        const u32 count = __builtin_popcountll(bm);
-        
-        const bool exists = bm & (1UL << hpiece);
-        if (exists)
+        u64 n = 0;
+        if (a == b)
+            n = sizeof(hamt<K,V,A,G>);
+        for (u32 i = 0; i < G::root_slots; ++i)
+            n += shared_row(a->data[i], b->data[i], 0);
+        return n;
+    }
+
+    // Reports how map b differs from map a: on_added(k, v) for each key only in b, on_removed(k, v)
+    // for each key only in a, and on_changed(k, va, vb) for each key in both whose value differs
+    // (as a pointer); k is the key as stored in a, except for on_added. The tries are walked
+    // together and any row identical in both is skipped whole, so for versions derived from
+    // one another this costs time in proportion to their differences and depth, not their size.
+    template <typename FA, typename FR, typename FC>
+    static void diff(const hamt<K,V,A,G>* const a, const hamt<K,V,A,G>* const b, FA on_added, FR on_removed, FC on_changed)
+    {
+        if (a == b)
+            return;
+        for (u32 i = 0; i < G::root_slots; ++i)
+            diff_row(a->data[i], b->data[i], 0, on_added, on_removed, on_changed);
+    }
+
+    // Returns an equal version stored in one contiguous block: the root, then every node in
+    // breadth-first order, so the levels nearest the root, which every lookup visits, sit
+    // together. With pairs set, each node's keys and values are also copied (by K's and V's copy
+    // constructors) to just after it, and the result's pairs point to the copies. The result
+    // is an ordinary version that later updates path copy from; with gc_alloc the block lives
+    // as long as any version points into it (this relies on the GC recognizing interior
+    // pointers, as it does by default).
+    const hamt<K,V,A,G>* compact(const bool pairs = false) const
+    {
+        const u64 align = pairs ? std::max<u64>(sizeof(u64), std::max(alignof(K), alignof(V))) : sizeof(u64);
+        u64 bytes = aligned(sizeof(hamt<K,V,A,G>), align)
+            + (pairs ? count*(aligned(sizeof(K), align) + aligned(sizeof(V), align)) : 0);
+        for (u32 i = 0; i < G::root_slots; ++i)
+            bytes += compact_bytes(this->data[i], 0, align);
+
+        u8* const block = (u8*)A::allocate(bytes);
+        hamt<K,V,A,G>* const r = (hamt<K,V,A,G>*)block;
+        std::memcpy(r, this, sizeof(hamt<K,V,A,G>));
+        u64 at = aligned(sizeof(hamt<K,V,A,G>), align);
+        std::deque<std::pair<KVtop*, u32> > queue;
+        compact_rows(r->data, G::root_slots, 0, block, &at, align, pairs, &queue);
+        while (!queue.empty())
         {
-            const u32 i = __builtin_popcountll((bm << 1) << (63 - hpiece));
-            
-            // Check to see what kind of KV pair this is by checking the lowest bit of k
-            if ((data[i].k.bm & 1) == 0)
-            {
-                // Does the K* match exactly?
-                if (*(data[i].k.key) == *key)
-                {
-                    if (count > 1)
-                    {
-                        // Create a new node, removing this kv
-                        (*cptr)--;
-                        KVnext* const node = (KVnext*)GC_MALLOC((count-1)*sizeof(KVnext));
-                        std::memcpy(node, data, i*sizeof(KV));
-                        std::memcpy(&(node[i]), &(data[i+1]), (count-1-i)*sizeof(KVnext));
-                        
-                        //  Remove this hpiece from the bitmap
-                        const u64 newbm = ((bm & (0xffffffffffffffff ^ (1UL << hpiece))) << 1) | 1;
-                        return KVtype(newbm, node);
-                    }
-                    else
-                    {
-                        (*cptr)--;
-                        return KVtype((K*)0, (V*)0);
-                    }
-                }
-                else
-                    // Key is already absent
-                    return kv;
-            }
-            else //if ((data[i].k & 1) == 1)
+            KVtop* const row = queue.front().first;
+            const u32 depth = queue.front().second;
+            queue.pop_front();
+            if (depth == G::bottom)
             {
-                // Try a remove_inner and see what comes back
-                const KVnext childkv = KVnext::remove_inner(data[i], h >> 6, key, cptr);
-                if (childkv == data[i])
-                    // Key was already absent within child node
-                    return kv;
-                else if (childkv.k.bm == 0)
-                {
-                    if (count > 1)
-                    {
-                        // Create a new node, removing this kv
-                        KVnext* const node = (KVnext*)GC_MALLOC((count-1)*sizeof(KVnext));
-                        std::memcpy(node, data, i*sizeof(KV));
-                        std::memcpy(&(node[i]), &(data[i+1]), (count-1-i)*sizeof(KVnext));
-                        
-                        // Remove this hpiece from the bitmap
-                        const u64 newbm = ((bm & (0xffffffffffffffff ^ (1UL << hpiece))) << 1) | 1;
-                        return KVtype(newbm, node);
-                    }
-                    else
-                        return KVtype((K*)0, (V*)0);
-                }
-                else 
+                const CN<K,V,A>* const cn = reinterpret_cast<const CN<K,V,A>*>(row->v.node);
+                CN<K,V,A>* const copy = (CN<K,V,A>*)(block + at);
+                std::memcpy(copy, cn, CN<K,V,A>::bytes(cn->count));
+                at += aligned(CN<K,V,A>::bytes(cn->count), align);
+                for (u64 i = 0; pairs && i < cn->count; ++i)
                 {
-                    const KVnext* const node = KVnext::update_node(data, count, i, childkv);
-                    return KVtype(kv.k.bm, node);
+                    const K* const k = new (block + at) K(*(cn->pairs()[i].k));
+                    at += aligned(sizeof(K), align);
+                    const V* const v = new (block + at) V(*(cn->pairs()[i].v));
+                    at += aligned(sizeof(V), align);
+                    copy->set(i, cn->hashes()[i], k, v);
                 }
+                new (row) KVtop(row->k.bm, (const KV<K,V,1,A,G>*)copy);
+                continue;
             }
+
+            const u32 count = __builtin_popcountll(row->k.bm >> 1);
+            KVtop* const node = (KVtop*)(block + at);
+            std::memcpy(node, row->v.node, count*sizeof(KVtop));
+            at += aligned(count*sizeof(KVtop), align);
+            new (row) KVtop(row->k.bm, (const KV<K,V,1,A,G>*)node);
+            compact_rows(node, count, depth+1, block, &at, align, pairs, &queue);
         }
-        else
-            // Key is already absent
-            return kv;
+        return r;
     }
-};
 
-
-// A template-specialized version of KV<K,V,d> for the lowest depth of inner nodes, d==bd
-// After this we have exhausted our 64 bit hash (4 bits used by the root and 6*10 bits used by inner nodes)
-template <typename K, typename V>
-class KV<K,V,bd>
-{
-    typedef LL<K,V> LLtype;
-    typedef KV<K,V,bd> KVbottom;
-    
-public:        
-    // We use two unions and the following cheap tagging scheme:
-    // when the lowest bit of Key k is 0, it's a key and a K*,V* pair (key and value),
-    // when the lowest bit of Key k is 1, it's either a bm (bitmap) in the top 63 bits with a 
-    // KVnext* v inner node pointer when d is less than bd-1 or it's just a 1 and a pointer to a
-    // LL<K,V>* for collisions (In this case we use LL<K,V>*)
-    union Key
+    // Returns an equal version whose nodes are shared with every other interned version that
+    // holds an equal subtree (hash-consing), so equal maps built independently end up as one
+    // root and compare equal by pointer. Nodes are equal when they hold the same key and value
+    // pointers, so equal keys or values stored as distinct objects are not merged. Interning
+    // a version derived from an interned one only visits the nodes built since. Interned
+    // nodes are kept in a weak global table and collected as usual, so this needs gc_alloc.
+    const hamt<K,V,A,G>* intern() const
     {
-        const u64 bm;
-        const K* const key;
+        static_assert(std::is_same<A, gc_alloc>::value, "intern() relies on the GC to drop unused nodes");
+        if (const void* const canonical = hamt_intern_table::find(this, sizeof(hamt<K,V,A,G>)))
+            return (const hamt<K,V,A,G>*)canonical;
 
-        Key(const K* const key) : key(key) { }
-        Key(const u64 bm) : bm(bm) { }
-    } k;
-        
-    union Val
-    {
-        const LLtype* const list;
-        const V* const val;
-            
-        Val(const LLtype* const ll) : list(ll) { }
-        Val(const V* const val) : val(val) { }
-    } v;
+        hamt<K,V,A,G>* const r = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+        std::memcpy(r, this, sizeof(hamt<K,V,A,G>));
+        for (u32 i = 0; i < G::root_slots; ++i)
+            new (&r->data[i]) KVtop(intern_row(this->data[i], 0));
+        return (const hamt<K,V,A,G>*)hamt_intern_table::intern(r, sizeof(hamt<K,V,A,G>));
+    }
 
-    // Copy constructor
-    KV<K,V,bd>(const KVbottom& o) : k(o.k), v(o.v) { }
+    // Writes this map to a snapshot file at path, which hamt_view (hamt_view.h) maps and reads in
+    // place. Keys and values are written through the codecs KC and VC (see hamt_pod_codec).
+    // The file is written beside path and renamed over it once complete, so readers never
+    // map a partial snapshot. Returns false if it couldn't be written.
+    template <typename KC = hamt_pod_codec<K>, typename VC = hamt_pod_codec<V> >
+    bool save(const char* const path) const
+    {
+        const std::string tmp = std::string(path) + ".tmp";
+        FILE* const f = std::fopen(tmp.c_str(), "wb");
+        hamt_snapshot_writer w(f);
+        hamt_snapshot_header header = hamt_snapshot_header::make<G>(0, 0);
+        w.put(&header, sizeof(header));
 
-    // The different cases spelled out as constructors
-    KV<K,V,bd>(const u64 bm, const LLtype* const ll) : k(bm), v(ll) { }
-    KV<K,V,bd>(const K* key, const V* val) : k(key), v(val) { }
+        u64 rows[2*G::root_slots];
+        for (u32 i = 0; i < G::root_slots; ++i)
+            save_row<KC,VC>(&w, this->data[i], 0, rows+2*i);
+        header = hamt_snapshot_header::make<G>(count, w.put(rows, sizeof(rows)));
 
-    // Equality check (doesn't actually matter which types k and v are)
-    bool operator==(const KVbottom& kv) const
-    {
-        return k.bm == kv.k.bm && v.val == kv.v.val;
+        bool ok = w.ok() && std::fseek(f, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = f && std::fclose(f) == 0 && ok;
+        if (ok && std::rename(tmp.c_str(), path) == 0)
+            return true;
+        std::remove(tmp.c_str());
+        return false;
     }
 
-    // kv is a row on the bottom depth db, so kv.v is a linked list
-    static const V* inner_find(const KVbottom& kv, const u64 h, const K* const key)
+    // Calls f(k, v) for every key/value pair, splitting the traversal over workers threads
+    // (by default one per hardware thread). Calls happen concurrently and in no particular
+    // order, and each worker calls its own copy of f. Subtrees expected to hold fewer than
+    // grain pairs are traversed by a single worker. Worker threads register themselves with
+    // the GC.
+    template <typename F>
+    void parallel_for_each(F f, u32 workers = 0, const u64 grain = 4096) const
     {
-        return kv.v.list->find(key);
-    }
-    
-    // This is a helper for returning a copy of an internal node with one row replaced by kv
-    static const KVbottom* update_node(const KVbottom* old, const u32 count, const u32 i, const KVbottom& kv)
-    {
-        KVbottom* copy = (KVbottom*)GC_MALLOC(count*sizeof(KVbottom));
-        std::memcpy(copy, old, count*sizeof(KV));
-        new (copy+i) KVbottom(kv);
-        return copy;
+        workers = default_workers(workers);
+        if (workers == 1 || count <= grain)
+            return for_each(f);
+
+        std::vector<F> visitors(workers, f);
+        parallel_visit(&visitors[0], workers, grain);
     }
-        
-    // Helper returns a fresh inner node for two merged h, k, v triples
-    static const KVbottom new_inner_node(const u64 h0, const K* const k0, const V* const v0,
-                                         const u64 h1, const K* const k1, const V* const v1)
+
+    // Returns the combination of map(k, v) over every key/value pair, computed in parallel as
+    // for parallel_for_each. combine must be associative and commutative with identity as its
+    // identity, as pairs are mapped and combined in no particular order.
+    template <typename R, typename M, typename C>
+    R parallel_reduce(const R& identity, M map, C combine, u32 workers = 0, const u64 grain = 4096) const
     {
-        const LLtype* const ll1 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(k0, v0, 0);
-        const LLtype* const ll0 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(k1, v1, ll1);
-        return KVbottom(1, ll0);
+        workers = default_workers(workers);
+        std::vector<reducer<R,M,C> > reducers(workers, reducer<R,M,C>(identity, &map, &combine));
+        if (workers == 1 || count <= grain)
+        {
+            reducer<R,M,C>& r0 = reducers[0];
+            for_each([&r0](const K* const k, const V* const v) { r0(k, v); });
+        }
+        else
+            parallel_visit(&reducers[0], workers, grain);
+
+        R r = identity;
+        for (u32 w = 0; w < workers; ++w)
+            r = combine(r, reducers[w].acc);
+        return r;
     }
-    
-    // Inserts an h, k, v into an existing KV and returns a fresh KV for extended hash
-    static const KVbottom insert_inner(const KVbottom& kv, const u64 h, const K* const key, const V* const val, u64* const cptr)
+
+    // A read-only forward iterator over all key/value pairs
+    // It keeps an explicit stack of (node, index) frames, one per depth up to G::bottom, so a
+    // full traversal allocates nothing. Every KV<K,V,d,A,G> row has the same layout, so the
+    // frames all view their rows as KVtop; the row's depth tells us how to read it.
+    class iterator
     {
-        if (kv.k.bm & 1UL)
-            return KVbottom(1UL, kv.v.list->insert(key, val, cptr));
-        else
+        typedef CN<K,V,A> CNtype;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const K*, const V*> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+    private:
+        const KVtop* node[G::bottom+1];
+        u32 idx[G::bottom+1];
+        u32 cnt[G::bottom+1];
+        s32 depth;
+        // The collision node being walked, if any, and the index of cur within it
+        const CNtype* cn;
+        u32 ci;
+        value_type cur;
+
+        // Moves to the next key/value pair, or to the end state (depth == -1)
+        void advance()
         {
-            // Does the K* match exactly?
-            if (*(kv.k.key) == *key)
+            if (cn && ++ci < cn->count)
             {
-                // Just replace the value  
-                return KVbottom(kv.k.key, val);
+                cur = value_type(cn->pairs()[ci].k, cn->pairs()[ci].v);
+                return;
             }
-            else
+            cn = 0;
+
+            while (depth >= 0)
             {
-                // We've run out of hash, merge them into a linked list
-                (*cptr)++;
-                const LLtype* const ll1 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(key, val, 0);
-                const LLtype* const ll0 = new ((LLtype*)GC_MALLOC(sizeof(LLtype))) LLtype(kv.k.key, kv.v.val, ll1);
-                return KVbottom(1UL, ll0);
+                if (idx[depth] == cnt[depth])
+                {
+                    --depth;
+                    continue;
+                }
+
+                const KVtop& row = node[depth][idx[depth]++];
+                if (row.k.bm == 0)
+                    // An empty root slot
+                    continue;
+                else if ((row.k.bm & 1) == 0)
+                {
+                    cur = value_type(row.k.key, row.v.val);
+                    return;
+                }
+                else if (depth == G::bottom)
+                {
+                    // Rows at the bottom depth point to collision nodes
+                    cn = reinterpret_cast<const CNtype*>(row.v.node);
+                    ci = 0;
+                    cur = value_type(cn->pairs()[0].k, cn->pairs()[0].v);
+                    return;
+                }
+                else
+                {
+                    ++depth;
+                    node[depth] = reinterpret_cast<const KVtop*>(row.v.node);
+                    idx[depth] = 0;
+                    cnt[depth] = __builtin_popcountll(row.k.bm >> 1);
+                }
             }
         }
-    }
 
-    // Removes an arbitrary key/value (setting the removed key/value to keyPtr and valPtr locations)
-    static const KVbottom removeFirst_inner(const KVbottom& kv, const K** const keyPtr, const V** const valPtr)
+    public:
+        // The end iterator
+        iterator()
+            : depth(-1), cn(0), ci(0), cur(0, 0)
+        { }
+
+        explicit iterator(const hamt<K,V,A,G>* const h)
+            : depth(0), cn(0), ci(0), cur(0, 0)
+        {
+            node[0] = h->data;
+            idx[0] = 0;
+            cnt[0] = G::root_slots;
+            advance();
+        }
+
+        reference operator*() const { return cur; }
+        pointer operator->() const { return &cur; }
+
+        iterator& operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator old(*this);
+            advance();
+            return old;
+        }
+
+        bool operator==(const iterator& o) const
+        {
+            if (depth != o.depth)
+                return false;
+            else if (depth < 0)
+                return true;
+            else
+                return node[depth] == o.node[depth] && idx[depth] == o.idx[depth] && cn == o.cn && ci == o.ci;
+        }
+
+        bool operator!=(const iterator& o) const
+        {
+            return !(*this == o);
+        }
+    };
+
+    iterator begin() const
     {
-        *keyPtr = kv.v.list->k;
-        *valPtr = kv.v.list->v;
-        const LLtype* const next = kv.v.list->next;
-        if (next)
-            return KVbottom(1, next);
-        else
-            return KVbottom((K*)0, (V*)0);
+        return iterator(this);
     }
 
-    // Removes a key on the bottom-depth inner-node row kv (h, key)
-    static const KVbottom remove_inner(const KVbottom& kv, const u64 h, const K* const key, u64* const cptr)
+    iterator end() const
     {
-        // kv.k.bm & 1 != 0 is checked by caller
-        const LLtype* const ll = kv.v.list->remove(key, cptr);
-        if (ll == kv.v.list) // Key was already absent within the list?
-            return kv;
-        else if (ll == 0) // List is now empty?
-            return KVbottom((K*)0, (V*)0);
-        else // Got a new linked list back.
-            return KVbottom(1, ll);
+        return iterator();
     }
 };
 
 
-
-// A simple hash-array-mapped trie implementation (Bagwell 2001)
-// Garbage collected, persistent/immutable hashmaps
-template<typename K, typename V>
-class hamt
+// A transient (Clojure-style mutable builder) over a hamt
+// Nodes this transient copies or allocates are owned by it (see hamt_edit) and later
+// updates change them in place instead of path copying, so a run of inserts or removes
+// allocates little beyond the nodes of the final map. persistent() hands back the
+// current version as an ordinary immutable hamt in O(1) by simply forgetting ownership;
+// the transient may keep being used after that and will path copy from that version.
+template <typename K, typename V, typename A, typename G>
+class transient_hamt
 {
-    typedef KV<K,V,0> KVtop;
-    
+    typedef KV<K,V,0,A,G> KVtop;
+
 private:
-    // We use up to 4 bits of the hash for the root, then the
-    // other 10*6bits are used for inner nodes up to 10 deep
-    KVtop data[rootsize];
-    u64 count; 
+    // root is 0 until the first edit after construction or persistent()
+    const hamt<K,V,A,G>* base;
+    hamt<K,V,A,G>* root;
+    hamt_edit<A> edit;
+
+    hamt<K,V,A,G>* editable_root()
+    {
+        if (!root)
+        {
+            root = (hamt<K,V,A,G>*)A::allocate(sizeof(hamt<K,V,A,G>));
+            std::memcpy(root, base, sizeof(hamt<K,V,A,G>));
+        }
+        return root;
+    }
 
 public:
-    hamt<K,V>()
-        : data{}, count(0)
+    explicit transient_hamt<K,V,A,G>(const hamt<K,V,A,G>* const h)
+        : base(h), root(0), edit()
     { }
-    
+
     const V* get(const K* const key) const
     {
-        // type K must support a method u64 hash() const; 
-        const u64 h = key->hash();
-        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
- 
-        if (this->data[hpiece].k.bm == 0)
-            // It's a zero, return null for failure
-            return 0;
-        else if ((this->data[hpiece].k.bm & 1) == 0)
-        {
-            // It's a key/value pair, check for equality
-            if (*(this->data[hpiece].k.key) == *key)
-            {
-                return this->data[hpiece].v.val;
-            }
-            else
-                return 0;
-        }
-        else
-            // It's an inner node
-            return KVtop::inner_find(this->data[hpiece], h >> 4, key);
+        return root ? root->get(key) : base->get(key);
     }
 
-    const hamt<K,V>* insert(const K* const key, const V* const val) const
+    const V* get(const K& key) const
     {
-        // type K must support a method u64 hash() const; 
-        const u64 h = key->hash();
-        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
+        return root ? root->get(key) : base->get(key);
+    }
 
-        // Make a copy to return; insert at bucket hpiece 
-        hamt<K,V>* new_root = (hamt<K,V>*)GC_MALLOC(sizeof(hamt<K,V>));
-        std::memcpy(new_root, this, sizeof(hamt<K,V>));
-        if (this->data[hpiece].k.bm == 0)
+    const V* get(const u64 h, const K& key) const
+    {
+        return root ? root->get(h, key) : base->get(h, key);
+    }
+
+    // Looks up the key equal to probe, as hamt::find does
+    template <typename P>
+    const V* find(const P& probe) const
+    {
+        return root ? root->find(probe) : base->find(probe);
+    }
+
+    u64 size() const
+    {
+        return root ? root->count : base->count;
+    }
+
+    transient_hamt<K,V,A,G>* insert(const K* const key, const V* const val)
+    {
+        // type K must support a method u64 hash() const;
+        return insert(key->hash(), key, val);
+    }
+
+    // Inserts key given its hash h, which must equal key->hash()
+    transient_hamt<K,V,A,G>* insert(const u64 h, const K* const key, const V* const val)
+    {
+        const u64 hpiece = G::root_piece(h);
+        hamt<K,V,A,G>* const r = editable_root();
+        r->update_content(r, h, key, val);
+
+        if (r->data[hpiece].k.bm == 0)
         {
-            // the root node has an empty bucket at hpiece
-            new (&new_root->data[hpiece]) KVtop(key,val);
-            (new_root->count)++;
+            new (&r->data[hpiece]) KVtop(key,val,h);
+            (r->count)++;
         }
-        else if ((this->data[hpiece].k.bm & 1) == 0)
+        else if ((r->data[hpiece].k.bm & 1) == 0)
         {
-            // the root node already has a key/value pair at hpiece
-            if (*(this->data[hpiece].k.key) == *key)
-                new (&new_root->data[hpiece]) KVtop(key,val);
+            if (r->data[hpiece].may_match(h) && *(r->data[hpiece].k.key) == *key)
+                new (&r->data[hpiece]) KVtop(key,val,h);
             else
             {
-                (new_root->count)++;
-                new (&new_root->data[hpiece]) KVtop(KVtop::new_inner_node(this->data[hpiece].k.key->hash() >> 4,
-                                                                          this->data[hpiece].k.key,
-                                                                          this->data[hpiece].v.val,
-                                                                          h >> 4, key, val));
+                (r->count)++;
+                const KVtop kv = KVtop::new_inner_node(r->data[hpiece].key_hash(),
+                                                       r->data[hpiece].k.key,
+                                                       r->data[hpiece].v.val,
+                                                       h, key, val);
+                KVtop::own_new_node(kv, &edit);
+                new (&r->data[hpiece]) KVtop(kv);
             }
         }
         else
-            // the root node has an inner node at index hpiece
-            new (&new_root->data[hpiece]) KVtop(KVtop::insert_inner(this->data[hpiece], h >> 4, key, val, &(new_root->count)));
-
-        return new_root;
-    }
-    
-    const hamt<K,V>* removeFirst(const K** const keyPtr, const V** const valPtr) const
-    {
-        for (u64 i = 0; i < rootsize; ++i)
         {
-            if ((this->data[i].k.bm & 1) == 1)
-            {
-                const KVtop kv = KVtop::removeFirst_inner(this->data[i], keyPtr, valPtr);
-                hamt<K,V>* new_root = (hamt<K,V>*)GC_MALLOC(sizeof(hamt<K,V>));
-                std::memcpy(new_root, this, sizeof(hamt<K,V>));
-                new (&new_root->data[i]) KVtop(kv);
-                new_root->count = this->count - 1;
-                return new_root;
-            }
-            else if (this->data[i].k.bm != 0)
-            { 
-                *keyPtr = this->data[i].k.key;
-                *valPtr = this->data[i].v.val;
-                return this->remove(*keyPtr);
-            }
+            const KVtop kv = KVtop::insert_inner_t(r->data[hpiece], h, key, val, &(r->count), &edit, true);
+            new (&r->data[hpiece]) KVtop(kv);
         }
 
         return this;
     }
 
-    const hamt<K,V>* remove(const K* const key) const
+    transient_hamt<K,V,A,G>* remove(const K* const key)
     {
-        // type K must support a method u64 hash() const; 
-        const u64 h = key->hash();
-        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
+        // type K must support a method u64 hash() const;
+        return remove(key->hash(), *key);
+    }
 
-        if (this->data[hpiece].k.bm == 0)
+    transient_hamt<K,V,A,G>* remove(const K& key)
+    {
+        return remove(key.hash(), key);
+    }
+
+    // Removes key given its hash h, which must equal key.hash()
+    transient_hamt<K,V,A,G>* remove(const u64 h, const K& key)
+    {
+        const u64 hpiece = G::root_piece(h);
+        const hamt<K,V,A,G>* const cur = root ? root : base;
+
+        if (cur->data[hpiece].k.bm == 0)
             return this;
-        else if ((this->data[hpiece].k.bm & 1) == 0)
-        { 
-            // the root node already has a key/value pair at hpiece
-            // (we turn on the lowest bit to indicate when it is not a K*)
-            if (*(this->data[hpiece].k.key) == *key)
-            { 
-                hamt<K,V>* new_root = (hamt<K,V>*)GC_MALLOC(sizeof(hamt<K,V>));
-                std::memcpy(new_root, this, sizeof(hamt<K,V>));
-                new (&(new_root->data[hpiece])) KVtop((K*)0,(V*)0);
-                --(new_root->count);
-                return new_root;
+        else if ((cur->data[hpiece].k.bm & 1) == 0)
+        {
+            if (cur->data[hpiece].may_match(h) && *(cur->data[hpiece].k.key) == key)
+            {
+                hamt<K,V,A,G>* const r = editable_root();
+                r->update_content(r, h, &key, 0);
+                new (&r->data[hpiece]) KVtop();
+                --(r->count);
             }
-            else
-                return this;
         }
         else
         {
-            // Try a remove_inner and see what comes back
-            u64 temp_count = this->count;
-            const KVtop kv = KVtop::remove_inner(this->data[hpiece], h >> 4, key, &temp_count);
-            if (kv == this->data[hpiece])
-                return this;
-            else
-            {
-                // We got back a new inner node and need to produce a new root
-                hamt<K,V>* new_root = (hamt<K,V>*)GC_MALLOC(sizeof(hamt<K,V>));
-                std::memcpy(new_root, this, sizeof(hamt<K,V>));
-                new (&new_root->data[hpiece]) KVtop(kv);
-                new_root->count = temp_count;
-                return new_root;
-            }
+            hamt<K,V,A,G>* const r = editable_root();
+            r->update_content(r, h, &key, 0);
+            const KVtop kv = KVtop::remove_inner_t(r->data[hpiece], h, &key, &(r->count), &edit, true);
+            new (&r->data[hpiece]) KVtop(kv);
         }
+
+        return this;
     }
 
-    u64 size() const
+    // Freezes the current contents as an immutable hamt in O(1)
+    const hamt<K,V,A,G>* persistent()
     {
-        return count;
+        if (root)
+        {
+            base = root;
+            root = 0;
+            edit.reset();
+        }
+        return base;
     }
 };
-
-
@@ -0,0 +1,445 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+#pragma once
+
+
+#include "hamt.h"
+
+
+// A persistent hash set of const K*, shaped like hamt but without a value in any row
+// A hamt used as a set (insert(k, k)) spends half of every row on a value pointer, and the
+// other half tagging the row; here a row is a single pointer, to a key or to a node, and
+// (as in inline_hamt) each node starts with bm, the hash pieces it holds, and nm, those of
+// its rows that refer to nodes in turn. An inner node of n rows is then 16 + 8n bytes,
+// against 16n for hamt, so nodes and scans touch about half as many cache lines. At the
+// bottom depth the hash is exhausted, and a node row refers to a collision node: a count
+// and that many keys. Versions are immutable, and add and erase path copy as hamt's
+// insert and remove do, returning this version when nothing changes; erase keeps the
+// trie canonical in the same way. Geometry G's fingerprints and content hashes don't apply.
+template <typename K, typename A = gc_alloc, typename G = hamt_geometry>
+class hamt_set
+{
+    typedef hamt_set<K,A,G> set_t;
+
+    struct node
+    {
+        u64 bm;
+        u64 nm;
+
+        const void** rows()
+        {
+            return reinterpret_cast<const void**>(this+1);
+        }
+
+        const void* const* rows() const
+        {
+            return reinterpret_cast<const void* const*>(this+1);
+        }
+    };
+
+    struct collision
+    {
+        u64 count;
+
+        const K** keys()
+        {
+            return reinterpret_cast<const K**>(this+1);
+        }
+
+        const K* const* keys() const
+        {
+            return reinterpret_cast<const K* const*>(this+1);
+        }
+    };
+
+    // A row as seen from its parent: p is 0, a key, or (when inner is set) a node
+    struct row
+    {
+        const void* p;
+        bool inner;
+    };
+
+    // Root slot i holds data[i], a node if bit i of nm is set
+    const void* data[G::root_slots];
+    u64 nm;
+    u64 count;
+
+    // The hash piece that selects among the children of a row at the given depth
+    static u32 piece(const u64 h, const u32 depth)
+    {
+        return G::piece(h >> (G::root_bits + G::bits*depth));
+    }
+
+    static node* make_node(const u64 bm, const u64 nm)
+    {
+        node* const n = (node*)A::allocate(sizeof(node) + __builtin_popcountll(bm)*sizeof(const void*));
+        n->bm = bm;
+        n->nm = nm;
+        return n;
+    }
+
+    static collision* make_collision(const u64 count)
+    {
+        collision* const c = (collision*)A::allocate(sizeof(collision) + count*sizeof(const K*));
+        c->count = count;
+        return c;
+    }
+
+    static row key_row(const K* const key)
+    {
+        return row{key, false};
+    }
+
+    // Returns the row at the given depth holding keys a and b, whose hashes are ha and hb
+    static row pair_row(const K* const a, const u64 ha, const K* const b, const u64 hb, const u32 depth)
+    {
+        if (depth == G::bottom)
+        {
+            collision* const c = make_collision(2);
+            c->keys()[0] = a;
+            c->keys()[1] = b;
+            return row{c, true};
+        }
+
+        const u32 pa = piece(ha, depth);
+        const u32 pb = piece(hb, depth);
+        if (pa == pb)
+        {
+            node* const n = make_node(1UL << pa, 1UL << pa);
+            n->rows()[0] = pair_row(a, ha, b, hb, depth+1).p;
+            return row{n, true};
+        }
+        node* const n = make_node((1UL << pa) | (1UL << pb), 0);
+        n->rows()[pa < pb ? 0 : 1] = a;
+        n->rows()[pa < pb ? 1 : 0] = b;
+        return row{n, true};
+    }
+
+    // Returns a copy of node n with row i (whose piece is bit) replaced by r
+    static const node* replaced(const node* const n, const u32 i, const u64 bit, const row r)
+    {
+        const u32 used = __builtin_popcountll(n->bm);
+        node* const copy = make_node(n->bm, r.inner ? n->nm | bit : n->nm & ~bit);
+        std::memcpy(copy->rows(), n->rows(), used*sizeof(const void*));
+        copy->rows()[i] = r.p;
+        return copy;
+    }
+
+    template <typename P>
+    static bool contains_row(row r, const u32 depth0, const u64 h, const P& key)
+    {
+        for (u32 depth = depth0; ; ++depth)
+        {
+            if (r.p == 0)
+                return false;
+            else if (!r.inner)
+                return *(const K*)r.p == key;
+            else if (depth == G::bottom)
+            {
+                const collision* const c = (const collision*)r.p;
+                for (u64 j = 0; j < c->count; ++j)
+                    if (*(c->keys()[j]) == key)
+                        return true;
+                return false;
+            }
+
+            const node* const n = (const node*)r.p;
+            const u64 bit = 1UL << piece(h, depth);
+            if (!(n->bm & bit))
+                return false;
+            r.p = n->rows()[__builtin_popcountll(n->bm & (bit - 1))];
+            r.inner = n->nm & bit;
+        }
+    }
+
+    // Returns row r (at the given depth) with key, whose hash is h, added, or r itself if
+    // it already holds an equal key
+    static row add_row(const row r, const u32 depth, const u64 h, const K* const key, u64* const cptr)
+    {
+        if (r.p == 0)
+        {
+            ++*cptr;
+            return key_row(key);
+        }
+        else if (!r.inner)
+        {
+            const K* const k = (const K*)r.p;
+            if (*k == *key)
+                return r;
+            ++*cptr;
+            // type K must support a method u64 hash() const;
+            return pair_row(k, k->hash(), key, h, depth);
+        }
+        else if (depth == G::bottom)
+        {
+            const collision* const c = (const collision*)r.p;
+            for (u64 j = 0; j < c->count; ++j)
+                if (*(c->keys()[j]) == *key)
+                    return r;
+            ++*cptr;
+            collision* const copy = make_collision(c->count+1);
+            std::memcpy(copy->keys(), c->keys(), c->count*sizeof(const K*));
+            copy->keys()[c->count] = key;
+            return row{copy, true};
+        }
+
+        const node* const n = (const node*)r.p;
+        const u64 bit = 1UL << piece(h, depth);
+        const u32 i = __builtin_popcountll(n->bm & (bit - 1));
+        if (n->bm & bit)
+        {
+            const row child{n->rows()[i], (n->nm & bit) != 0};
+            const row added = add_row(child, depth+1, h, key, cptr);
+            return added.p == child.p ? r : row{replaced(n, i, bit, added), true};
+        }
+
+        ++*cptr;
+        const u32 used = __builtin_popcountll(n->bm);
+        node* const copy = make_node(n->bm | bit, n->nm);
+        std::memcpy(copy->rows(), n->rows(), i*sizeof(const void*));
+        std::memcpy(copy->rows()+i+1, n->rows()+i, (used-i)*sizeof(const void*));
+        copy->rows()[i] = key;
+        return row{copy, true};
+    }
+
+    // Returns row r (at the given depth) without key, whose hash is h, or r itself if key
+    // is absent. As in hamt, a node left holding a lone key is replaced by that key.
+    template <typename P>
+    static row erase_row(const row r, const u32 depth, const u64 h, const P& key, u64* const cptr)
+    {
+        if (r.p == 0)
+            return r;
+        else if (!r.inner)
+        {
+            if (!(*(const K*)r.p == key))
+                return r;
+            --*cptr;
+            return row{0, false};
+        }
+        else if (depth == G::bottom)
+        {
+            const collision* const c = (const collision*)r.p;
+            u64 j = 0;
+            while (j < c->count && !(*(c->keys()[j]) == key))
+                ++j;
+            if (j == c->count)
+                return r;
+            --*cptr;
+            if (c->count == 2)
+                return key_row(c->keys()[1-j]);
+            collision* const copy = make_collision(c->count-1);
+            std::memcpy(copy->keys(), c->keys(), j*sizeof(const K*));
+            std::memcpy(copy->keys()+j, c->keys()+j+1, (c->count-1-j)*sizeof(const K*));
+            return row{copy, true};
+        }
+
+        const node* const n = (const node*)r.p;
+        const u64 bit = 1UL << piece(h, depth);
+        if (!(n->bm & bit))
+            return r;
+        const u32 i = __builtin_popcountll(n->bm & (bit - 1));
+        const row child{n->rows()[i], (n->nm & bit) != 0};
+        const row erased = erase_row(child, depth+1, h, key, cptr);
+        if (erased.p == child.p && erased.inner == child.inner)
+            return r;
+
+        const u32 used = __builtin_popcountll(n->bm);
+        if (erased.p != 0)
+        {
+            // A lone key moves up in place of its node
+            if (used == 1 && !erased.inner)
+                return erased;
+            return row{replaced(n, i, bit, erased), true};
+        }
+        else if (used == 1)
+            return row{0, false};
+        else if (used == 2 && !(n->nm & ~bit))
+            return key_row((const K*)n->rows()[1-i]);
+
+        node* const copy = make_node(n->bm & ~bit, n->nm & ~bit);
+        std::memcpy(copy->rows(), n->rows(), i*sizeof(const void*));
+        std::memcpy(copy->rows()+i, n->rows()+i+1, (used-1-i)*sizeof(const void*));
+        return row{copy, true};
+    }
+
+    // True if every key beneath row a is beneath row b, both at the given depth
+    static bool subset_row(const row a, const row b, const u32 depth)
+    {
+        if (a.p == 0 || a.p == b.p)
+            return true;
+        else if (b.p == 0)
+            return false;
+        else if (!a.inner)
+            return contains_row(b, depth, ((const K*)a.p)->hash(), *(const K*)a.p);
+        else if (!b.inner)
+            // A node holds at least two keys
+            return false;
+        else if (depth == G::bottom)
+        {
+            const collision* const c = (const collision*)a.p;
+            const collision* const d = (const collision*)b.p;
+            if (c->count > d->count)
+                return false;
+            for (u64 i = 0; i < c->count; ++i)
+            {
+                bool found = false;
+                for (u64 j = 0; j < d->count && !found; ++j)
+                    found = *(c->keys()[i]) == *(d->keys()[j]);
+                if (!found)
+                    return false;
+            }
+            return true;
+        }
+
+        const node* const na = (const node*)a.p;
+        const node* const nb = (const node*)b.p;
+        if (na->bm & ~nb->bm)
+            return false;
+        u32 i = 0;
+        for (u64 rest = na->bm; rest; rest &= rest - 1, ++i)
+        {
+            const u64 bit = rest & (0 - rest);
+            const row ca{na->rows()[i], (na->nm & bit) != 0};
+            const row cb{nb->rows()[__builtin_popcountll(nb->bm & (bit - 1))], (nb->nm & bit) != 0};
+            if (!subset_row(ca, cb, depth+1))
+                return false;
+        }
+        return true;
+    }
+
+    template <typename F>
+    static void for_each_row(const row r, const u32 depth, F& f)
+    {
+        if (r.p == 0)
+            return;
+        else if (!r.inner)
+            return f((const K*)r.p);
+        else if (depth == G::bottom)
+        {
+            const collision* const c = (const collision*)r.p;
+            for (u64 j = 0; j < c->count; ++j)
+                f(c->keys()[j]);
+            return;
+        }
+
+        const node* const n = (const node*)r.p;
+        u32 i = 0;
+        for (u64 rest = n->bm; rest; rest &= rest - 1, ++i)
+            for_each_row(row{n->rows()[i], (n->nm & (rest & (0 - rest))) != 0}, depth+1, f);
+    }
+
+    row root_row(const u32 slot) const
+    {
+        return row{data[slot], ((nm >> slot) & 1) != 0};
+    }
+
+    // Returns a new version with root slot set to r and the given count
+    const set_t* with_row(const u32 slot, const row r, const u64 newcount) const
+    {
+        set_t* const s = (set_t*)A::allocate(sizeof(set_t));
+        std::memcpy((void*)s, (const void*)this, sizeof(set_t));
+        s->data[slot] = r.p;
+        s->nm = r.inner ? nm | (1UL << slot) : nm & ~(1UL << slot);
+        s->count = newcount;
+        return s;
+    }
+
+public:
+    hamt_set()
+        : data{}, nm(0), count(0)
+    { }
+
+    u64 size() const
+    {
+        return count;
+    }
+
+    bool contains(const K* const key) const
+    {
+        // type K must support a method u64 hash() const;
+        return contains(key->hash(), *key);
+    }
+
+    bool contains(const K& key) const
+    {
+        return contains(key.hash(), key);
+    }
+
+    // As above, with key's hash h already computed; key may be a K or any probe type P for
+    // which K == P is defined and hashes alike, as for hamt::find
+    template <typename P>
+    bool contains(const u64 h, const P& key) const
+    {
+        return contains_row(root_row(G::root_piece(h)), 0, h, key);
+    }
+
+    // Returns a version with key added, or this one if an equal key is already present
+    const set_t* add(const K* const key) const
+    {
+        // type K must support a method u64 hash() const;
+        return add(key->hash(), key);
+    }
+
+    const set_t* add(const u64 h, const K* const key) const
+    {
+        const u32 slot = G::root_piece(h);
+        const row r = root_row(slot);
+        u64 newcount = count;
+        const row added = add_row(r, 0, h, key, &newcount);
+        return added.p == r.p ? this : with_row(slot, added, newcount);
+    }
+
+    // Returns a version without key, or this one if it's absent
+    const set_t* erase(const K* const key) const
+    {
+        // type K must support a method u64 hash() const;
+        return erase(key->hash(), *key);
+    }
+
+    const set_t* erase(const K& key) const
+    {
+        return erase(key.hash(), key);
+    }
+
+    template <typename P>
+    const set_t* erase(const u64 h, const P& key) const
+    {
+        const u32 slot = G::root_piece(h);
+        const row r = root_row(slot);
+        u64 newcount = count;
+        const row erased = erase_row(r, 0, h, key, &newcount);
+        return newcount == count ? this : with_row(slot, erased, newcount);
+    }
+
+    // True if every key of this set is in other
+    // Both tries are walked together, and subtrees the two versions share are skipped.
+    bool subset_of(const set_t* const other) const
+    {
+        if (count > other->count)
+            return false;
+        for (u32 i = 0; i < G::root_slots; ++i)
+            if (!subset_row(root_row(i), other->root_row(i), 0))
+                return false;
+        return true;
+    }
+
+    bool operator==(const set_t& o) const
+    {
+        return count == o.count && subset_of(&o);
+    }
+
+    bool operator!=(const set_t& o) const
+    {
+        return !(*this == o);
+    }
+
+    // Calls f(k) for every key
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (u32 i = 0; i < G::root_slots; ++i)
+            for_each_row(root_row(i), 0, f);
+    }
+};
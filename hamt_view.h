@@ -0,0 +1,158 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+#pragma once
+
+
+#include "hamt.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// A read-only map served straight from a memory-mapped snapshot written by hamt::save
+// Nothing is deserialized on open: lookups walk the file's rows just as get walks a hamt's
+// nodes, and return pointers into the mapping that stay valid until the view is deleted. The
+// mapping is shared and read-only, so processes viewing the same snapshot share its pages.
+// KC, VC and G must be those the snapshot was saved with; open() checks the geometry.
+template <typename K, typename V, typename KC = hamt_pod_codec<K>, typename VC = hamt_pod_codec<V>,
+          typename G = hamt_geometry>
+class hamt_view
+{
+    typedef typename KC::stored KS;
+    typedef typename VC::stored VS;
+
+    const u8* const base;
+    const u64 bytes;
+
+    hamt_view(const u8* const base, const u64 bytes)
+        : base(base), bytes(bytes)
+    { }
+
+    hamt_view(const hamt_view&) = delete;
+    hamt_view& operator=(const hamt_view&) = delete;
+
+    const hamt_snapshot_header& header() const
+    {
+        return *reinterpret_cast<const hamt_snapshot_header*>(base);
+    }
+
+    const u64* at(const u64 offset) const
+    {
+        return reinterpret_cast<const u64*>(base + offset);
+    }
+
+    // Calls f(k, v) for every pair beneath row, which is at the given depth (the root's rows are depth 0)
+    template <typename F>
+    void for_each_row(const u64* const row, const u32 depth, F& f) const
+    {
+        if (row[0] == 0)
+            return;
+        else if ((row[0] & 1) == 0)
+            f(reinterpret_cast<const KS*>(at(row[0])), reinterpret_cast<const VS*>(at(row[1])));
+        else if (depth == G::bottom)
+        {
+            const u64* const block = at(row[1]);
+            const u64 count = block[0];
+            for (u64 i = 0; i < count; ++i)
+                f(reinterpret_cast<const KS*>(at(block[1+count+2*i])), reinterpret_cast<const VS*>(at(block[2+count+2*i])));
+        }
+        else
+        {
+            const u64* const node = at(row[1]);
+            const u32 count = __builtin_popcountll(row[0] >> 1);
+            for (u32 i = 0; i < count; ++i)
+                for_each_row(node+2*i, depth+1, f);
+        }
+    }
+
+public:
+    // Maps the snapshot at path, returning 0 if it can't be read or wasn't saved with geometry G
+    static hamt_view* open(const char* const path)
+    {
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return 0;
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (u64)st.st_size >= sizeof(hamt_snapshot_header))
+            map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            return 0;
+
+        hamt_view* const view = new hamt_view((const u8*)map, st.st_size);
+        const hamt_snapshot_header& h = view->header();
+        if (!h.template matches<G>() || h.root + 2*G::root_slots*sizeof(u64) > view->bytes)
+        {
+            delete view;
+            return 0;
+        }
+        return view;
+    }
+
+    ~hamt_view()
+    {
+        munmap(const_cast<u8*>(base), bytes);
+    }
+
+    u64 size() const
+    {
+        return header().count;
+    }
+
+    const VS* get(const K& key) const
+    {
+        // type K must support a method u64 hash() const;
+        return find(key.hash(), key);
+    }
+
+    // Looks up the key equal to probe, for which KC::equal(stored key, probe) must be defined
+    // and probe.hash() must give the hash of the key it stands for
+    template <typename P>
+    const VS* find(const P& probe) const
+    {
+        return find(probe.hash(), probe);
+    }
+
+    // As above, with the probe's hash h already computed
+    template <typename P>
+    const VS* find(const u64 h, const P& probe) const
+    {
+        const u64* row = at(header().root) + 2*G::root_piece(h);
+        for (u32 depth = 0; ; ++depth)
+        {
+            if (row[0] == 0)
+                return 0;
+            else if ((row[0] & 1) == 0)
+                return KC::equal(*reinterpret_cast<const KS*>(at(row[0])), probe) ? reinterpret_cast<const VS*>(at(row[1])) : 0;
+            else if (depth == G::bottom)
+            {
+                // Rows at the bottom depth point to collision blocks
+                const u64* const block = at(row[1]);
+                const u64 count = block[0];
+                for (u64 i = 0; i < count; ++i)
+                    if (block[1+i] == h && KC::equal(*reinterpret_cast<const KS*>(at(block[1+count+2*i])), probe))
+                        return reinterpret_cast<const VS*>(at(block[2+count+2*i]));
+                return 0;
+            }
+
+            const u64 bm = row[0] >> 1;
+            const u32 hpiece = G::piece(h >> (G::root_bits + G::bits*depth));
+            if (!(bm & (1UL << hpiece)))
+                return 0;
+            row = at(row[1]) + 2*__builtin_popcountll((bm << 1) << (63 - hpiece));
+        }
+    }
+
+    // Calls f(k, v) for every pair, where k and v point to the stored key and value
+    template <typename F>
+    void for_each(F f) const
+    {
+        const u64* const root = at(header().root);
+        for (u32 i = 0; i < G::root_slots; ++i)
+            for_each_row(root+2*i, 0, f);
+    }
+};
@@ -0,0 +1,430 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+#pragma once
+
+
+#include "hamt.h"
+#include <type_traits>
+
+
+// Hashes keys stored by value; by default this calls the key's own u64 hash() const,
+// and it is specialized for integers and pairs so those may be used directly as keys
+template <typename K>
+struct hamt_hash
+{
+    u64 operator()(const K& key) const
+    {
+        return key.hash();
+    }
+};
+
+// The splitmix64 finalizer, which spreads integer keys over all 64 bits of the hash
+inline u64 hamt_mix(u64 x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+template <> struct hamt_hash<u64> { u64 operator()(const u64 key) const { return hamt_mix(key); } };
+template <> struct hamt_hash<u32> { u64 operator()(const u32 key) const { return hamt_mix(key); } };
+template <> struct hamt_hash<s64> { u64 operator()(const s64 key) const { return hamt_mix((u64)key); } };
+template <> struct hamt_hash<s32> { u64 operator()(const s32 key) const { return hamt_mix((u64)(s64)key); } };
+
+template <typename A, typename B>
+struct hamt_hash<std::pair<A,B> >
+{
+    u64 operator()(const std::pair<A,B>& key) const
+    {
+        return hamt_mix(hamt_hash<A>()(key.first) * 0x9e3779b97f4a7c15 + hamt_hash<B>()(key.second));
+    }
+};
+
+
+// One row of an inline_hamt node; like KV, this is either a key/value pair or a reference
+// to an inner node, but the key and value are stored by value in the row itself.
+// A K may use all of its bits, so unlike KV there is no tag bit in the row: each inner-node
+// reference carries a second bitmap, nm, marking which of its rows are inner-node
+// references in turn (and the root keeps one for its slots). An inner row is thus
+// bm (which hash pieces are present), nm (which of those are inner nodes), and the node.
+// At the bottom depth bd the hash is exhausted, and an inner row instead refers to a flat
+// array of colliding pairs, with bm holding their count.
+template <typename K, typename V>
+class IKV
+{
+    typedef IKV<K,V> IKVtype;
+
+public:
+    struct Pair
+    {
+        K key;
+        V val;
+
+        Pair(const K& key, const V& val) : key(key), val(val) { }
+    };
+
+    struct Ref
+    {
+        u64 bm;
+        u64 nm;
+        const IKVtype* node;
+    };
+
+    union
+    {
+        Pair p;
+        Ref r;
+    };
+
+    IKV<K,V>() { r.bm = 0; r.nm = 0; r.node = 0; }
+    IKV<K,V>(const K& key, const V& val) : p(key, val) { }
+    IKV<K,V>(const u64 bm, const u64 nm, const IKVtype* const node) { r.bm = bm; r.nm = nm; r.node = node; }
+    IKV<K,V>(const IKVtype& o) { std::memcpy((void*)this, (const void*)&o, sizeof(IKVtype)); }
+};
+
+
+// A persistent hashmap like hamt, storing small trivially-copyable keys and values inline
+// Where hamt's rows hold a const K* and const V* (so every lookup that reaches a leaf
+// dereferences the key, and every key must be allocated separately), this keeps both
+// inside the node arrays, copying them on insert. get returns a pointer into the node,
+// which stays valid for as long as this version is reachable. It uses the same geometry
+// as hamt: 7 root slots, 63-way inner nodes, and flat collision arrays below depth bd.
+template <typename K, typename V, typename A = gc_alloc, typename Hash = hamt_hash<K> >
+class inline_hamt
+{
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "inline_hamt stores keys and values by value and copies them as raw bytes");
+
+    typedef IKV<K,V> IKVtype;
+    typedef inline_hamt<K,V,A,Hash> IHtype;
+
+    // What remove_inner left behind in place of the row it was given
+    enum removed { unchanged, pair, inner };
+
+private:
+    IKVtype data[rootsize];
+    u64 bm;
+    u64 nm;
+    u64 count;
+
+    // The part of h that selects among the children of an inner row at depth d
+    static u64 child_hash(const u64 h, const u32 d)
+    {
+        return d < bd ? h >> (4 + 6*d) : 0;
+    }
+
+    static IKVtype* new_node(const u32 count)
+    {
+        return (IKVtype*)A::allocate(count*sizeof(IKVtype));
+    }
+
+    // Returns a copy of the count rows at old with row i replaced by kv
+    static const IKVtype* update_node(const IKVtype* const old, const u32 count, const u32 i, const IKVtype& kv)
+    {
+        IKVtype* const node = new_node(count);
+        std::memcpy((void*)node, (const void*)old, count*sizeof(IKVtype));
+        new (node+i) IKVtype(kv);
+        return node;
+    }
+
+    // Returns a copy of the count rows at old with kv inserted as row i
+    static const IKVtype* insert_row(const IKVtype* const old, const u32 count, const u32 i, const IKVtype& kv)
+    {
+        IKVtype* const node = new_node(count+1);
+        std::memcpy((void*)node, (const void*)old, i*sizeof(IKVtype));
+        std::memcpy((void*)(node+i+1), (const void*)(old+i), (count-i)*sizeof(IKVtype));
+        new (node+i) IKVtype(kv);
+        return node;
+    }
+
+    // Returns a copy of the count rows at old without row i
+    static const IKVtype* remove_row(const IKVtype* const old, const u32 count, const u32 i)
+    {
+        IKVtype* const node = new_node(count-1);
+        std::memcpy((void*)node, (const void*)old, i*sizeof(IKVtype));
+        std::memcpy((void*)(node+i), (const void*)(old+i+1), (count-1-i)*sizeof(IKVtype));
+        return node;
+    }
+
+    // Returns an inner row at depth d holding pairs a and b, whose hashes ha and hb are
+    // already shifted for the children of depth d
+    static const IKVtype new_inner_node(const IKVtype& a, const u64 ha, const IKVtype& b, const u64 hb, const u32 d)
+    {
+        if (d == bd)
+        {
+            IKVtype* const node = new_node(2);
+            new (node+0) IKVtype(a);
+            new (node+1) IKVtype(b);
+            return IKVtype(2, 0, node);
+        }
+
+        const u32 pa = (ha & 0x3f) % 63;
+        const u32 pb = (hb & 0x3f) % 63;
+        if (pa == pb)
+        {
+            IKVtype* const node = new_node(1);
+            new (node+0) IKVtype(new_inner_node(a, ha >> 6, b, hb >> 6, d+1));
+            return IKVtype(1UL << pa, 1UL << pa, node);
+        }
+        else
+        {
+            IKVtype* const node = new_node(2);
+            new (node+(pa < pb ? 0 : 1)) IKVtype(a);
+            new (node+(pa < pb ? 1 : 0)) IKVtype(b);
+            return IKVtype((1UL << pa) | (1UL << pb), 0, node);
+        }
+    }
+
+    // Returns the value for key beneath the inner row at depth d, given h already shifted
+    // for that row's children
+    static const V* inner_find(const IKVtype* row, u64 h, const K& key, u32 d)
+    {
+        for (;; ++d, h >>= 6)
+        {
+            const u64 rbm = row->r.bm;
+            const IKVtype* const node = row->r.node;
+            if (d == bd)
+            {
+                // A collision array, where bm is the count of pairs
+                for (u32 i = 0; i < rbm; ++i)
+                    if (node[i].p.key == key)
+                        return &node[i].p.val;
+                return 0;
+            }
+
+            const u64 bit = 1UL << ((h & 0x3f) % 63);
+            if (!(rbm & bit))
+                return 0;
+            const IKVtype* const child = node + __builtin_popcountll(rbm & (bit - 1));
+            if (!(row->r.nm & bit))
+                return child->p.key == key ? &child->p.val : 0;
+            row = child;
+        }
+    }
+
+    // Inserts key and val beneath the inner row at depth d, returning its replacement
+    static const IKVtype insert_inner(const IKVtype& row, const u64 h, const K& key, const V& val, const u32 d, u64* const cptr)
+    {
+        const u64 rbm = row.r.bm;
+        const u64 rnm = row.r.nm;
+        const IKVtype* const node = row.r.node;
+        if (d == bd)
+        {
+            for (u32 i = 0; i < rbm; ++i)
+                if (node[i].p.key == key)
+                    return IKVtype(rbm, 0, update_node(node, rbm, i, IKVtype(key, val)));
+            (*cptr)++;
+            return IKVtype(rbm+1, 0, insert_row(node, rbm, rbm, IKVtype(key, val)));
+        }
+
+        const u64 bit = 1UL << ((h & 0x3f) % 63);
+        const u32 count = __builtin_popcountll(rbm);
+        const u32 i = __builtin_popcountll(rbm & (bit - 1));
+        if (!(rbm & bit))
+        {
+            (*cptr)++;
+            return IKVtype(rbm | bit, rnm, insert_row(node, count, i, IKVtype(key, val)));
+        }
+        else if (rnm & bit)
+            return IKVtype(rbm, rnm, update_node(node, count, i, insert_inner(node[i], h >> 6, key, val, d+1, cptr)));
+        else if (node[i].p.key == key)
+            return IKVtype(rbm, rnm, update_node(node, count, i, IKVtype(key, val)));
+        else
+        {
+            // Merge the two pairs into a new inner node
+            (*cptr)++;
+            const IKVtype child = new_inner_node(node[i], child_hash(Hash()(node[i].p.key), d+1),
+                                                 IKVtype(key, val), h >> 6, d+1);
+            return IKVtype(rbm, rnm | bit, update_node(node, count, i, child));
+        }
+    }
+
+    // Removes key from beneath the inner row at depth d, returning its replacement and
+    // setting *what to say what kind of row that is. Nodes are kept canonical: a subtree left
+    // holding a single pair is replaced by that pair, so no inner node holds just one pair.
+    static const IKVtype remove_inner(const IKVtype& row, const u64 h, const K& key, const u32 d,
+                                      u64* const cptr, removed* const what)
+    {
+        const u64 rbm = row.r.bm;
+        const u64 rnm = row.r.nm;
+        const IKVtype* const node = row.r.node;
+        *what = unchanged;
+        if (d == bd)
+        {
+            for (u32 i = 0; i < rbm; ++i)
+                if (node[i].p.key == key)
+                {
+                    (*cptr)--;
+                    if (rbm == 2)
+                    {
+                        *what = pair;
+                        return node[1-i];
+                    }
+                    *what = inner;
+                    return IKVtype(rbm-1, 0, remove_row(node, rbm, i));
+                }
+            return row;
+        }
+
+        const u64 bit = 1UL << ((h & 0x3f) % 63);
+        if (!(rbm & bit))
+            return row;
+        const u32 count = __builtin_popcountll(rbm);
+        const u32 i = __builtin_popcountll(rbm & (bit - 1));
+        if (rnm & bit)
+        {
+            removed cw;
+            const IKVtype child = remove_inner(node[i], h >> 6, key, d+1, cptr, &cw);
+            if (cw == unchanged)
+                return row;
+            else if (cw == pair && count == 1)
+            {
+                // This node only held that subtree, so collapse it too
+                *what = pair;
+                return child;
+            }
+            *what = inner;
+            return IKVtype(rbm, cw == pair ? rnm & ~bit : rnm, update_node(node, count, i, child));
+        }
+        else if (!(node[i].p.key == key))
+            return row;
+
+        (*cptr)--;
+        if (count == 2 && rnm == 0)
+        {
+            // Just the other pair is left
+            *what = pair;
+            return node[1-i];
+        }
+        *what = inner;
+        return IKVtype(rbm & ~bit, rnm, remove_row(node, count, i));
+    }
+
+    // Calls f(key, val) on every pair beneath the inner row at depth d
+    template <typename F>
+    static void for_each_inner(const IKVtype& row, const u32 d, F& f)
+    {
+        const IKVtype* const node = row.r.node;
+        if (d == bd)
+        {
+            for (u32 i = 0; i < row.r.bm; ++i)
+                f(node[i].p.key, node[i].p.val);
+            return;
+        }
+
+        u32 i = 0;
+        for (u64 rest = row.r.bm; rest; rest &= rest - 1, ++i)
+        {
+            if (row.r.nm & rest & (0 - rest))
+                for_each_inner(node[i], d+1, f);
+            else
+                f(node[i].p.key, node[i].p.val);
+        }
+    }
+
+public:
+    inline_hamt<K,V,A,Hash>()
+        : bm(0), nm(0), count(0)
+    { }
+
+    const V* get(const K& key) const
+    {
+        const u64 h = Hash()(key);
+        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
+        const u64 bit = 1UL << hpiece;
+
+        if (!(this->bm & bit))
+            return 0;
+        else if (!(this->nm & bit))
+            return this->data[hpiece].p.key == key ? &this->data[hpiece].p.val : 0;
+        else
+            return inner_find(&this->data[hpiece], h >> 4, key, 0);
+    }
+
+    const IHtype* insert(const K& key, const V& val) const
+    {
+        const u64 h = Hash()(key);
+        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
+        const u64 bit = 1UL << hpiece;
+
+        IHtype* const new_root = (IHtype*)A::allocate(sizeof(IHtype));
+        std::memcpy((void*)new_root, (const void*)this, sizeof(IHtype));
+        if (!(this->bm & bit))
+        {
+            new (&new_root->data[hpiece]) IKVtype(key, val);
+            new_root->bm |= bit;
+            (new_root->count)++;
+        }
+        else if (this->nm & bit)
+            new (&new_root->data[hpiece]) IKVtype(insert_inner(this->data[hpiece], h >> 4, key, val, 0, &new_root->count));
+        else if (this->data[hpiece].p.key == key)
+            new (&new_root->data[hpiece]) IKVtype(key, val);
+        else
+        {
+            (new_root->count)++;
+            new (&new_root->data[hpiece]) IKVtype(new_inner_node(this->data[hpiece], child_hash(Hash()(this->data[hpiece].p.key), 0),
+                                                                 IKVtype(key, val), h >> 4, 0));
+            new_root->nm |= bit;
+        }
+
+        return new_root;
+    }
+
+    const IHtype* remove(const K& key) const
+    {
+        const u64 h = Hash()(key);
+        const u64 hpiece = (h & 0x11000000000000f) % rootsize;
+        const u64 bit = 1UL << hpiece;
+
+        if (!(this->bm & bit))
+            return this;
+
+        u64 newcount = this->count;
+        removed what;
+        if (this->nm & bit)
+        {
+            const IKVtype row = remove_inner(this->data[hpiece], h >> 4, key, 0, &newcount, &what);
+            if (what == unchanged)
+                return this;
+
+            IHtype* const new_root = (IHtype*)A::allocate(sizeof(IHtype));
+            std::memcpy((void*)new_root, (const void*)this, sizeof(IHtype));
+            new (&new_root->data[hpiece]) IKVtype(row);
+            if (what == pair)
+                new_root->nm &= ~bit;
+            new_root->count = newcount;
+            return new_root;
+        }
+        else if (!(this->data[hpiece].p.key == key))
+            return this;
+
+        IHtype* const new_root = (IHtype*)A::allocate(sizeof(IHtype));
+        std::memcpy((void*)new_root, (const void*)this, sizeof(IHtype));
+        new (&new_root->data[hpiece]) IKVtype();
+        new_root->bm &= ~bit;
+        (new_root->count)--;
+        return new_root;
+    }
+
+    u64 size() const
+    {
+        return count;
+    }
+
+    // Calls f(key, val) for every key/value pair
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (u32 i = 0; i < rootsize; ++i)
+        {
+            if (!(this->bm & (1UL << i)))
+                continue;
+            else if (this->nm & (1UL << i))
+                for_each_inner(this->data[i], 0, f);
+            else
+                f(this->data[i].p.key, this->data[i].p.val);
+        }
+    }
+};
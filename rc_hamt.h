@@ -0,0 +1,422 @@
+// Copyright (C) 2017 Thomas Gilray, Kristopher Micinski
+// See the notice in LICENSE.md
+
+
+#pragma once
+
+
+#include "hamt.h"
+#include <atomic>
+
+
+// A reference-counted hamt, for programs that can't afford the GC's pauses
+// An rc_hamt is a value: copying one shares its trie in O(1), and each copy then evolves on
+// its own, as versions of a hamt do. Every node counts the rows and maps that refer to it and
+// is freed as soon as that count drops to zero. insert and remove copy only the nodes on
+// their path that are shared; a node referred to once (as along every path of a map that was
+// never copied) is updated in place, so a run of updates to one map allocates little beyond
+// its growth. Keys and values are not owned, and must outlive the maps that refer to them.
+// The trie has hamt's shape for geometry G (without fingerprints or content hashes), and
+// removals keep it canonical in the same way. Distinct maps may be used from different
+// threads, even when they share nodes, but one map must not be updated concurrently.
+template <typename K, typename V, typename A = malloc_alloc, typename G = hamt_geometry>
+class rc_hamt
+{
+    // A row is empty (k is 0), a key/value pair (k is an even K*), or refers to a node (k is
+    // odd): an inner node with bitmap k >> 1 above the bottom depth, and a collision node at it
+    struct row
+    {
+        u64 k;
+        const void* v;
+    };
+
+    // A node's header, which its rows follow; count is the number of pairs in a root, and of
+    // rows in a collision node (an inner node has as many rows as its bitmap has bits)
+    struct node
+    {
+        std::atomic<u32> refs;
+        u32 cap;
+        u64 count;
+
+        explicit node(const u32 cap)
+            : refs(1), cap(cap), count(0)
+        { }
+
+        row* rows()
+        {
+            return reinterpret_cast<row*>(this+1);
+        }
+
+        const row* rows() const
+        {
+            return reinterpret_cast<const row*>(this+1);
+        }
+    };
+
+    // 0 while the map is empty
+    node* root;
+
+    // A new node with room for cap empty rows, referred to once
+    static node* make(const u32 cap)
+    {
+        node* const n = new (A::allocate(sizeof(node) + cap*sizeof(row))) node(cap);
+        std::memset(n->rows(), 0, cap*sizeof(row));
+        return n;
+    }
+
+    static void free_node(node* const n)
+    {
+        A::deallocate(n, sizeof(node) + n->cap*sizeof(row));
+    }
+
+    // The hash piece that selects among the children of a row at the given depth
+    static u32 piece(const u64 h, const u32 depth)
+    {
+        return G::piece(h >> (G::root_bits + G::bits*depth));
+    }
+
+    static void retain_rows(const row* const rows, const u32 used)
+    {
+        for (u32 i = 0; i < used; ++i)
+            if (rows[i].k & 1)
+                ((node*)rows[i].v)->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drops a reference to n, whose first used rows are at the given depth, freeing it and
+    // dropping its own references once none remain
+    static void release_node(node* const n, const u32 used, const u32 depth)
+    {
+        if (n->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        for (u32 i = 0; i < used; ++i)
+            release_row(n->rows()[i], depth);
+        free_node(n);
+    }
+
+    // Drops row r's reference (at the given depth) to the node it refers to, if any
+    static void release_row(const row& r, const u32 depth)
+    {
+        if ((r.k & 1) == 0)
+            return;
+        node* const n = (node*)r.v;
+        release_node(n, depth < G::bottom ? __builtin_popcountll(r.k >> 1) : n->count, depth+1);
+    }
+
+    // Returns n (which has used rows, at the given depth) ready to be changed in place with room
+    // for cap rows: n itself if nothing else refers to it and it has the room, and otherwise a
+    // copy that takes over this reference to n. A copy of a shared node shares its children,
+    // so they are copied in turn if the change reaches them. limit caps a grown node's room.
+    static node* writable(node* const n, const u32 used, const u32 cap, const u32 limit, const u32 depth)
+    {
+        const bool unique = n->refs.load(std::memory_order_acquire) == 1;
+        if (unique && n->cap >= cap)
+            return n;
+
+        // Like a transient, leave room to grow a node that keeps being updated in place
+        node* const copy = make(unique ? std::max(cap, std::min(limit, 2*used)) : cap);
+        std::memcpy(copy->rows(), n->rows(), used*sizeof(row));
+        copy->count = n->count;
+        if (unique)
+            free_node(n);
+        else
+        {
+            retain_rows(copy->rows(), used);
+            release_node(n, used, depth);
+        }
+        return copy;
+    }
+
+    // Sets key (whose hash is h) to val beneath row r at the given depth; r sits in a node
+    // this map alone refers to
+    static void insert_row(row& r, const u32 depth, const u64 h, const K* const key, const V* const val,
+                           u64* const count)
+    {
+        if (r.k == 0)
+        {
+            r.k = (u64)key;
+            r.v = val;
+            ++*count;
+            return;
+        }
+        else if ((r.k & 1) == 0)
+        {
+            if (*(const K*)r.k == *key)
+            {
+                r.k = (u64)key;
+                r.v = val;
+                return;
+            }
+            else if (depth == G::bottom)
+            {
+                // The hash is exhausted; the two pairs form a collision node
+                node* const c = make(2);
+                c->rows()[0] = r;
+                c->rows()[1].k = (u64)key;
+                c->rows()[1].v = val;
+                c->count = 2;
+                r.k = 1;
+                r.v = c;
+                ++*count;
+                return;
+            }
+
+            // Push the pair down into a node of its own, then insert beside it
+            node* const n = make(2);
+            n->rows()[0] = r;
+            r.k = ((1UL << piece(((const K*)r.k)->hash(), depth)) << 1) | 1;
+            r.v = n;
+        }
+
+        node* n = (node*)r.v;
+        if (depth == G::bottom)
+        {
+            n = writable(n, n->count, n->count+1, ~0u, depth+1);
+            r.v = n;
+            row* const rows = n->rows();
+            for (u64 j = 0; j < n->count; ++j)
+                if (*(const K*)rows[j].k == *key)
+                {
+                    rows[j].k = (u64)key;
+                    rows[j].v = val;
+                    return;
+                }
+            rows[n->count].k = (u64)key;
+            rows[n->count].v = val;
+            ++n->count;
+            ++*count;
+            return;
+        }
+
+        const u64 bm = r.k >> 1;
+        const u64 bit = 1UL << piece(h, depth);
+        const u32 used = __builtin_popcountll(bm);
+        const u32 i = __builtin_popcountll(bm & (bit - 1));
+        if (bm & bit)
+        {
+            n = writable(n, used, used, G::width, depth+1);
+            r.v = n;
+            insert_row(n->rows()[i], depth+1, h, key, val, count);
+            return;
+        }
+
+        n = writable(n, used, used+1, G::width, depth+1);
+        row* const rows = n->rows();
+        std::memmove(rows+i+1, rows+i, (used-i)*sizeof(row));
+        rows[i].k = (u64)key;
+        rows[i].v = val;
+        r.k = ((bm | bit) << 1) | 1;
+        r.v = n;
+        ++*count;
+    }
+
+    // Removes key (whose hash is h, and which is present) beneath row r at the given depth;
+    // r sits in a node this map alone refers to. As in hamt, a node left empty or holding
+    // a lone pair is removed, the pair taking its place.
+    static void remove_row(row& r, const u32 depth, const u64 h, const K& key)
+    {
+        if ((r.k & 1) == 0)
+        {
+            r.k = 0;
+            r.v = 0;
+            return;
+        }
+
+        node* n = (node*)r.v;
+        if (depth == G::bottom)
+        {
+            n = writable(n, n->count, n->count, ~0u, depth+1);
+            row* const rows = n->rows();
+            u64 j = 0;
+            while (!(*(const K*)rows[j].k == key))
+                ++j;
+            rows[j] = rows[--n->count];
+            if (n->count == 1)
+            {
+                r = rows[0];
+                free_node(n);
+            }
+            else
+                r.v = n;
+            return;
+        }
+
+        u64 bm = r.k >> 1;
+        const u64 bit = 1UL << piece(h, depth);
+        u32 used = __builtin_popcountll(bm);
+        const u32 i = __builtin_popcountll(bm & (bit - 1));
+        n = writable(n, used, used, G::width, depth+1);
+        row* const rows = n->rows();
+        remove_row(rows[i], depth+1, h, key);
+        if (rows[i].k == 0)
+        {
+            std::memmove(rows+i, rows+i+1, (used-1-i)*sizeof(row));
+            bm &= ~bit;
+            --used;
+        }
+
+        if (used == 0 || (used == 1 && (rows[0].k & 1) == 0))
+        {
+            if (used == 0)
+            {
+                r.k = 0;
+                r.v = 0;
+            }
+            else
+                r = rows[0];
+            free_node(n);
+        }
+        else
+        {
+            r.k = (bm << 1) | 1;
+            r.v = n;
+        }
+    }
+
+    template <typename F>
+    static void for_each_row(const row& r, const u32 depth, F& f)
+    {
+        if (r.k == 0)
+            return;
+        else if ((r.k & 1) == 0)
+            return f((const K*)r.k, (const V*)r.v);
+
+        const node* const n = (const node*)r.v;
+        const u32 used = depth < G::bottom ? __builtin_popcountll(r.k >> 1) : n->count;
+        for (u32 i = 0; i < used; ++i)
+            for_each_row(n->rows()[i], depth+1, f);
+    }
+
+    // Makes root ready to be changed in place
+    void writable_root()
+    {
+        root = root ? writable(root, G::root_slots, G::root_slots, G::root_slots, 0) : make(G::root_slots);
+    }
+
+public:
+    rc_hamt()
+        : root(0)
+    { }
+
+    rc_hamt(const rc_hamt& o)
+        : root(o.root)
+    {
+        if (root)
+            root->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    rc_hamt(rc_hamt&& o)
+        : root(o.root)
+    {
+        o.root = 0;
+    }
+
+    rc_hamt& operator=(rc_hamt o)
+    {
+        std::swap(root, o.root);
+        return *this;
+    }
+
+    ~rc_hamt()
+    {
+        if (root)
+            release_node(root, G::root_slots, 0);
+    }
+
+    u64 size() const
+    {
+        return root ? root->count : 0;
+    }
+
+    const V* get(const K* const key) const
+    {
+        // type K must support a method u64 hash() const;
+        return find(key->hash(), *key);
+    }
+
+    const V* get(const K& key) const
+    {
+        return find(key.hash(), key);
+    }
+
+    // Looks up the key equal to probe, which may be a K or any P as for hamt::find
+    template <typename P>
+    const V* find(const P& probe) const
+    {
+        return find(probe.hash(), probe);
+    }
+
+    template <typename P>
+    const V* find(const u64 h, const P& probe) const
+    {
+        if (!root)
+            return 0;
+        const row* r = root->rows() + G::root_piece(h);
+        for (u32 depth = 0; ; ++depth)
+        {
+            if (r->k == 0)
+                return 0;
+            else if ((r->k & 1) == 0)
+                return *(const K*)r->k == probe ? (const V*)r->v : 0;
+
+            const node* const n = (const node*)r->v;
+            if (depth == G::bottom)
+            {
+                for (u64 j = 0; j < n->count; ++j)
+                    if (*(const K*)n->rows()[j].k == probe)
+                        return (const V*)n->rows()[j].v;
+                return 0;
+            }
+
+            const u64 bm = r->k >> 1;
+            const u64 bit = 1UL << piece(h, depth);
+            if (!(bm & bit))
+                return 0;
+            r = n->rows() + __builtin_popcountll(bm & (bit - 1));
+        }
+    }
+
+    // Maps key to val in this map; other maps sharing its nodes are unaffected
+    void insert(const K* const key, const V* const val)
+    {
+        // type K must support a method u64 hash() const;
+        insert(key->hash(), key, val);
+    }
+
+    void insert(const u64 h, const K* const key, const V* const val)
+    {
+        // Don't copy a shared path just to store the value already there
+        if (root && root->refs.load(std::memory_order_acquire) != 1 && find(h, *key) == val)
+            return;
+        writable_root();
+        insert_row(root->rows()[G::root_piece(h)], 0, h, key, val, &root->count);
+    }
+
+    void remove(const K* const key)
+    {
+        // type K must support a method u64 hash() const;
+        remove(key->hash(), *key);
+    }
+
+    void remove(const K& key)
+    {
+        remove(key.hash(), key);
+    }
+
+    void remove(const u64 h, const K& key)
+    {
+        if (find(h, key) == 0)
+            return;
+        writable_root();
+        remove_row(root->rows()[G::root_piece(h)], 0, h, key);
+        --root->count;
+    }
+
+    // Calls f(k, v) for every key/value pair
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (root)
+            for (u32 i = 0; i < G::root_slots; ++i)
+                for_each_row(root->rows()[i], 0, f);
+    }
+};
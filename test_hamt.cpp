@@ -4,6 +4,11 @@
 
 #include "gc.h"
 #include "hamt.h"
+#include "inline_hamt.h"
+#include "atomic_hamt.h"
+#include "hamt_view.h"
+#include "rc_hamt.h"
+#include "hamt_set.h"
 #include <iostream>
 #include <cstdlib>
 #include <chrono>
@@ -50,6 +55,77 @@ public:
 };
 
 
+// A tuple with a deliberately weak hash, leaving only 64 distinct values, so nearly
+// every key ends up in a collision node at the bottom depth
+class weaktuple : public tuple
+{
+public:
+    weaktuple(u64 x, u64 y, u64 z)
+        : tuple(x, y, z)
+    {}
+
+    u64 hash() const
+    {
+        return tuple::hash() & 0x7000003000000001;
+    }
+};
+
+// A tuple that counts how often keys are compared for equality
+static u64 compares = 0;
+
+class countedtuple : public tuple
+{
+public:
+    countedtuple(u64 x, u64 y, u64 z)
+        : tuple(x, y, z)
+    {}
+
+    bool operator==(const countedtuple& t) const
+    {
+        ++compares;
+        return tuple::operator==(t);
+    }
+};
+
+// A colliding tuple that counts how often keys are hashed
+static u64 hashes = 0;
+
+class hashedtuple : public weaktuple
+{
+public:
+    hashedtuple(u64 x, u64 y, u64 z)
+        : weaktuple(x, y, z)
+    {}
+
+    u64 hash() const
+    {
+        ++hashes;
+        return weaktuple::hash();
+    }
+};
+
+// A probe standing for the tuple (x, x+1, x*x) without being one, for heterogeneous lookup
+class tupleprobe
+{
+public:
+    u64 x;
+
+    tupleprobe(u64 x)
+        : x(x)
+    {}
+
+    u64 hash() const
+    {
+        return tuple(x, x+1, x*x).hash();
+    }
+};
+
+bool operator==(const tuple& t, const tupleprobe& p)
+{
+    return t.x == p.x && t.y == p.x+1 && t.z == p.x*p.x;
+}
+
+
 void report_gc_size()
 {
     // Can be added back in for debugging purposes if desired
@@ -82,9 +158,9 @@ void testround()
     for (u32 j = 0; j < 2; ++j)
         for (u32 i = offset; i < offset+loops; ++i)
         {
-            const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+            const tuple t(i,i+1,i*i);
             const tuple* const t2 = h->get(t);
-            if (t2 == 0 || !(*t == *t2))
+            if (t2 == 0 || !(t == *t2))
                 exit(1);
             if (i % 50000 == 0) report_gc_size();
         }
@@ -93,7 +169,7 @@ void testround()
     for (u32 j = 0; j < 2; ++j)
         for (u32 i = 0x80000000; i < 0x80000000+loops; ++i)
         {
-            const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+            const tuple t(i,i+1,i*i);
             const tuple* const t2 = h->get(t);
             if (!(t2 == 0))
                 exit(1);
@@ -104,10 +180,11 @@ void testround()
     for (u32 j = 0; j < 6; ++j)
         for (u32 i = offset-100; i < offset+(loops/6)*j; ++i)
         {
-            const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
-            h = h->remove(t);
+            const tuple t(i,i+1,i*i);
+            const u64 hash = t.hash();
+            h = h->remove(hash, t);
             // Check that it is really gone
-            const tuple* const t2 = h->get(t);
+            const tuple* const t2 = h->get(hash, t);
             if (!(t2 == 0))
                 exit(1);
             if (i % 50000 == 0) report_gc_size();
@@ -138,14 +215,11 @@ void testround()
         {
             // Do an insert
             const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(rand()%0xfffffff,rand()%0xffff,rand()%0xfffff); 
-            const hamt<tuple, tuple>* rest = (m = m->insert(t,t));
+            m = m->insert(t,t);
             const hamt<tuple, tuple>* seen = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
-            while (rest->size())
+            for (const auto& kv : *m)
             {
-                const tuple* k0 = 0;
-                rest = rest->removeFirst(&k0, &k0);
-                //std::cout << "sz: " << rest->size() << std::endl;
-                //std::cout << "k0: " << k0->x << std::endl;
+                const tuple* const k0 = kv.first;
                 if (k0 == 0)
                 {    std::cout << "NULL encountered during traversal" << std::endl; exit(1); }
                 else if (seen->get(k0) != 0)
@@ -158,6 +232,8 @@ void testround()
                 {    std::cout << "Randomly extended m doesn't match prev's val" << std::endl; exit(1); }
                 seen = seen->insert(k0,k0);
             }
+            if (seen->size() != m->size())
+            {    std::cout << "Traversal of m missed some tuples" << std::endl; exit(1); }
         }
         else if (op == 1)
         {
@@ -193,12 +269,9 @@ void testround()
             const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(kk->x,kk->y,kk->z); 
             rest = m->remove(t);
             seen = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
-            while (rest->size())
+            for (hamt<tuple, tuple>::iterator it = rest->begin(); it != rest->end(); ++it)
             {
-                const tuple* k0 = 0;
-                rest = rest->removeFirst(&k0, &k0);
-                //std::cout << "sz: " << rest->size() << std::endl;
-                //std::cout << "k0: " << k0->x << std::endl;
+                const tuple* const k0 = it->first;
                 if (k0 == 0)
                 {    std::cout << "NULL encountered during traversal.." << std::endl; exit(1); }
                 else if (seen->get(k0) != 0)
@@ -207,17 +280,1227 @@ void testround()
                 {    std::cout << "removed tuple encountered during traversal!" << std::endl; exit(1); }    
                 seen = seen->insert(k0,k0);
             }
+            if (seen->size() != rest->size())
+            {    std::cout << "Traversal of m missed some tuples." << std::endl; exit(1); }
+
+            // for_each must visit the same pairs as the iterator
+            u64 n = 0;
+            rest->for_each([&](const tuple* k0, const tuple* v0) {
+                    if (seen->get(k0) != v0) { std::cout << "for_each disagrees with iterator" << std::endl; exit(1); }
+                    ++n;
+                });
+            if (n != rest->size())
+            {    std::cout << "for_each missed some tuples" << std::endl; exit(1); }
         }
     }
 }
 
 
+void testtransient()
+{
+    const u32 loops = 50000;
+    const hamt<tuple, tuple>* const empty = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+
+    // Build half the keys through a transient and freeze a snapshot
+    transient_hamt<tuple, tuple>* const t = empty->transient();
+    for (u32 i = 0; i < loops/2; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        t->insert(k,k);
+    }
+    const hamt<tuple, tuple>* const half = t->persistent();
+
+    // Keep editing after persistent(); the snapshot must not change
+    for (u32 i = loops/2; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        t->insert(k,k);
+    }
+    for (u32 i = 0; i < loops; i += 3)
+    {
+        const tuple k(i,i+1,i*i);
+        t->remove(&k);
+    }
+    const hamt<tuple, tuple>* const h = t->persistent();
+
+    if (empty->size() != 0 || half->size() != loops/2 || h->size() != loops - (loops+2)/3)
+    {    std::cout << "Transient produced the wrong sizes" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        const tuple* const v = h->get(&k);
+        if ((v != 0) != (i % 3 != 0) || (v && !(*v == k)))
+        {    std::cout << "Transient lost or kept the wrong tuple" << std::endl; exit(1); }
+        if ((half->get(&k) != 0) != (i < loops/2))
+        {    std::cout << "Transient edits leaked into a persistent snapshot" << std::endl; exit(1); }
+    }
+
+    u64 n = 0;
+    for (const auto& kv : *h)
+        if (kv.first == kv.second) ++n;
+    if (n != h->size())
+    {    std::cout << "Transient result iterates incorrectly" << std::endl; exit(1); }
+}
+
+
+void testfromrange()
+{
+    const u32 loops = 50000;
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+
+    // Include every tenth key twice; the later pair must win, as with insert
+    std::pair<const tuple*, const tuple*>* const pairs
+        = (std::pair<const tuple*, const tuple*>*)GC_MALLOC((loops + loops/10)*sizeof(std::pair<const tuple*, const tuple*>));
+    u32 n = 0;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        pairs[n++] = std::make_pair(t,t);
+        h = h->insert(t,t);
+        if (i % 10 == 0)
+        {
+            const tuple* const v = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+2,i);
+            pairs[n++] = std::make_pair(t,v);
+            h = h->insert(t,v);
+        }
+    }
+
+    const hamt<tuple, tuple>* b = hamt<tuple, tuple>::from_range(pairs, pairs+n);
+    if (b->size() != h->size())
+    {    std::cout << "from_range built the wrong size" << std::endl; exit(1); }
+
+    // Identical layouts iterate in the same order
+    hamt<tuple, tuple>::iterator it = h->begin();
+    for (const auto& kv : *b)
+    {
+        if (it == h->end() || !(*(it->first) == *(kv.first)) || it->second != kv.second)
+        {    std::cout << "from_range layout differs from repeated insert" << std::endl; exit(1); }
+        ++it;
+    }
+
+    for (u32 i = 0; i < loops; i += 7)
+    {
+        const tuple k(i,i+1,i*i);
+        if (b->get(&k) != h->get(&k))
+        {    std::cout << "from_range lookup mismatch" << std::endl; exit(1); }
+        b = b->remove(&k);
+        if (b->get(&k) != 0)
+        {    std::cout << "from_range result does not support remove" << std::endl; exit(1); }
+    }
+}
+
+
+const tuple* keep_left(const tuple* k, const tuple* v0, const tuple* v1)
+{
+    return v0;
+}
+
+
+// Set operations on maps whose equal keys are distinct objects keep the left map's key
+// pointers, wherever one map has a lone pair and the other an inner or collision node
+template <typename T>
+void testsetkeys()
+{
+    typedef hamt<T,T> map_t;
+    const u32 loops = 2000;
+    const u32 step = 400;
+    const T** const big_keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    const T** const small_keys = (const T**)GC_MALLOC(loops/step*sizeof(const T*));
+    const map_t* big = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const map_t* small = big;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        big_keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        big = big->insert(big_keys[i], big_keys[i]);
+        if (i % step == 0)
+        {
+            small_keys[i/step] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+            small = small->insert(small_keys[i/step], small_keys[i/step]);
+        }
+    }
+
+    auto keep_right = [](const T* k, const T* a, const T* b) { return b; };
+    bool ok = true;
+    auto from_big = [&ok, big_keys](const T* k, const T* v) { ok = ok && k == big_keys[k->x]; };
+    auto from_small = [&ok, small_keys](const T* k, const T* v) { ok = ok && k == small_keys[k->x/step]; };
+    auto small_first = [&ok, big_keys, small_keys](const T* k, const T* v)
+        { ok = ok && k == (k->x % step == 0 ? small_keys[k->x/step] : big_keys[k->x]); };
+    const map_t* const bs = big->intersect(small);
+    const map_t* const sb = small->intersect(big);
+    bs->for_each(from_big);
+    sb->for_each(from_small);
+    big->union_with(small, keep_right)->for_each(from_big);
+    small->union_with(big, keep_right)->for_each(small_first);
+    if (!ok || bs->size() != loops/step || sb->size() != loops/step)
+    {    std::cout << "Set operations kept the other map's key" << std::endl; exit(1); }
+}
+
+void testsetops()
+{
+    const u32 loops = 20000;
+    const hamt<tuple, tuple>* a = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        a = a->insert(t,t);
+    }
+
+    // b shares most of a's structure: it drops every fifth key and adds a few hundred new ones
+    const hamt<tuple, tuple>* b = a;
+    for (u32 i = 0; i < loops; i += 5)
+    {
+        const tuple k(i,i+1,i*i);
+        b = b->remove(&k);
+    }
+    for (u32 i = loops; i < loops+300; ++i)
+    {
+        const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        b = b->insert(t,t);
+    }
+
+    const hamt<tuple, tuple>* const u = a->union_with(b, keep_left);
+    const hamt<tuple, tuple>* const n = a->intersect(b);
+    const hamt<tuple, tuple>* const d = a->difference(b);
+    if (u->size() != loops+300 || n->size() != loops - loops/5 || d->size() != loops/5)
+    {    std::cout << "Set operations produced the wrong sizes" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops+300; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        const bool ina = i < loops;
+        const bool inb = i >= loops || i % 5 != 0;
+        if ((u->get(&k) != 0) != (ina || inb)
+            || (n->get(&k) != 0) != (ina && inb)
+            || (d->get(&k) != 0) != (ina && !inb))
+        {    std::cout << "Set operations misplaced a tuple" << std::endl; exit(1); }
+    }
+
+    if (a->union_with(a, keep_left) != a || a->intersect(a) != a || a->difference(a)->size() != 0)
+    {    std::cout << "Set operations of a map with itself should reuse it" << std::endl; exit(1); }
+
+    testsetkeys<tuple>();
+    testsetkeys<weaktuple>();
+}
+
+
+template <typename A>
+void testalloc()
+{
+    const u32 loops = 20000;
+
+    // Maps using arena_alloc or pool_alloc are not scanned by the GC, so keep the keys alive here
+    tuple* const keys = (tuple*)GC_MALLOC(loops*sizeof(tuple));
+    const hamt<tuple, tuple, A> empty;
+    const hamt<tuple, tuple, A>* h = &empty;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        new (keys+i) tuple(i,i+1,i*i);
+        h = h->insert(keys+i, keys+i);
+    }
+    transient_hamt<tuple, tuple, A>* const t = h->transient();
+    for (u32 i = 0; i < loops; i += 2)
+        t->remove(keys+i);
+    const hamt<tuple, tuple, A>* const odd = t->persistent();
+
+    if (h->size() != loops || odd->size() != loops/2)
+    {    std::cout << "Allocation policy changed the sizes" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        if (h->get(&k) != keys+i || (odd->get(&k) != 0) != (i % 2 == 1))
+        {    std::cout << "Allocation policy lost a tuple" << std::endl; exit(1); }
+    }
+}
+
+
+void testinline()
+{
+    const u32 loops = 50000;
+
+    // Keys and values are copied into the nodes, so probes and values can live on the stack
+    const inline_hamt<tuple, u64>* h = new ((inline_hamt<tuple,u64>*)GC_MALLOC(sizeof(inline_hamt<tuple,u64>))) inline_hamt<tuple,u64>();
+    const inline_hamt<u64, u64>* n = new ((inline_hamt<u64,u64>*)GC_MALLOC(sizeof(inline_hamt<u64,u64>))) inline_hamt<u64,u64>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        h = h->insert(tuple(i,i+1,i*i), i);
+        n = n->insert(i, 2*i);
+    }
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        h = h->remove(tuple(i,i+1,i*i));
+        n = n->remove(i);
+    }
+
+    if (h->size() != loops/2 || n->size() != loops/2)
+    {    std::cout << "inline_hamt has the wrong size" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const u64* const v = h->get(tuple(i,i+1,i*i));
+        const u64* const w = n->get(i);
+        if ((v != 0) != (i % 2 == 1) || (v && *v != i) || (w != 0) != (i % 2 == 1) || (w && *w != 2*i))
+        {    std::cout << "inline_hamt lost or kept the wrong pair" << std::endl; exit(1); }
+    }
+
+    u64 sum = 0;
+    n->for_each([&](const u64 k, const u64 v) { sum += v - k; });
+    if (sum != (u64)(loops/2)*(loops/2))
+    {    std::cout << "inline_hamt for_each visited the wrong pairs" << std::endl; exit(1); }
+}
+
+
+void testgetmany()
+{
+    const u32 loops = 20000;
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        h = h->insert(t,t);
+    }
+
+    // Interleave hits and misses; n is deliberately not a multiple of the group size
+    const u32 n = 2*loops+5;
+    const tuple** const keys = (const tuple**)GC_MALLOC(n*sizeof(const tuple*));
+    const tuple** const out = (const tuple**)GC_MALLOC(n*sizeof(const tuple*));
+    for (u32 i = 0; i < n; ++i)
+    {
+        const u32 x = i % 2 == 0 ? i/2 : 0x80000000+i;
+        keys[i] = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(x,x+1,x*x);
+    }
+
+    h->get_many(keys, n, out);
+    for (u32 i = 0; i < n; ++i)
+        if (out[i] != h->get(keys[i]) || (i % 2 == 0 && i/2 < loops) != (out[i] != 0))
+        {    std::cout << "get_many disagrees with get" << std::endl; exit(1); }
+}
+
+
+void testcollisions()
+{
+    const u32 loops = 4000;
+    const hamt<weaktuple, weaktuple>* h = new ((hamt<weaktuple,weaktuple>*)GC_MALLOC(sizeof(hamt<weaktuple,weaktuple>))) hamt<weaktuple,weaktuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const weaktuple* const t = new ((weaktuple*)GC_MALLOC(sizeof(weaktuple))) weaktuple(i,i+1,i*i);
+        h = h->insert(t,t);
+    }
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        const weaktuple k(i,i+1,i*i);
+        h = h->remove(&k);
+    }
+
+    if (h->size() != loops/2)
+    {    std::cout << "Colliding keys give the wrong size" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const weaktuple k(i,i+1,i*i);
+        const weaktuple* const v = h->get(&k);
+        if ((v != 0) != (i % 2 == 1) || (v && !(*v == k)))
+        {    std::cout << "Colliding keys lost or kept the wrong tuple" << std::endl; exit(1); }
+    }
+
+    u64 n = 0;
+    for (const auto& kv : *h)
+        if (kv.first == kv.second) ++n;
+    if (n != h->size())
+    {    std::cout << "Colliding keys iterate incorrectly" << std::endl; exit(1); }
+
+    // Drain what's left one arbitrary pair at a time
+    while (h->size() > 0)
+    {
+        const weaktuple* k = 0;
+        const weaktuple* v = 0;
+        h = h->removeFirst(&k, &v);
+        if (k != v || h->get(k) != 0)
+        {    std::cout << "removeFirst on colliding keys failed" << std::endl; exit(1); }
+    }
+}
+
+
+void testatomic()
+{
+    const u32 threads = 4;
+    const u32 loops = 5000;
+    atomic_hamt<tuple, tuple> shared;
+
+    // Each writer inserts its own keys, then removes every third of them; a reader takes
+    // snapshots meanwhile, which must never change under it
+    GC_allow_register_threads();
+    std::thread workers[threads+1];
+    for (u32 w = 0; w < threads; ++w)
+        workers[w] = std::thread([&shared, w]()
+            {
+                gc_thread_scope gc;
+                for (u32 i = w*loops; i < (w+1)*loops; ++i)
+                {
+                    const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+                    shared.insert(t,t);
+                }
+                for (u32 i = w*loops; i < (w+1)*loops; i += 3)
+                {
+                    const tuple k(i,i+1,i*i);
+                    shared.remove(&k);
+                }
+            });
+    bool stable = true;
+    workers[threads] = std::thread([&shared, &stable]()
+        {
+            gc_thread_scope gc;
+            for (u32 j = 0; j < 50; ++j)
+            {
+                const hamt<tuple, tuple>* const snap = shared.load();
+                const u64 n = snap->size();
+                u64 m = 0;
+                for (const auto& kv : *snap)
+                    if (kv.first == kv.second) ++m;
+                stable = stable && m == n;
+            }
+        });
+    for (u32 w = 0; w <= threads; ++w)
+        workers[w].join();
+
+    if (!stable)
+    {    std::cout << "atomic_hamt snapshot changed while being read" << std::endl; exit(1); }
+    if (shared.size() != threads*(loops - (loops+2)/3))
+    {    std::cout << "atomic_hamt lost concurrent updates" << std::endl; exit(1); }
+    for (u32 i = 0; i < threads*loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        if ((shared.get(&k) != 0) != ((i % loops) % 3 != 0))
+        {    std::cout << "atomic_hamt lost or kept the wrong tuple" << std::endl; exit(1); }
+    }
+}
+
+
+void testparallel()
+{
+    const u32 loops = 100000;
+    transient_hamt<tuple, tuple>* const t = (new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>())->transient();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        t->insert(k,k);
+    }
+    const hamt<tuple, tuple>* const h = t->persistent();
+
+    // A small grain forces splitting well below the root
+    const u64 sum = h->parallel_reduce((u64)0,
+                                       [](const tuple* k, const tuple* v) { return k->x + v->y; },
+                                       [](u64 a, u64 b) { return a + b; },
+                                       4, 64);
+    if (sum != (u64)loops*loops)
+    {    std::cout << "parallel_reduce computed the wrong sum" << std::endl; exit(1); }
+
+    std::atomic<u64> visits(0);
+    h->parallel_for_each([&visits](const tuple* k, const tuple* v) { if (k == v) visits.fetch_add(1); }, 4, 64);
+    if (visits.load() != loops)
+    {    std::cout << "parallel_for_each missed or repeated pairs" << std::endl; exit(1); }
+}
+
+
+void teststats()
+{
+    const u32 loops = 20000;
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    const hamt<weaktuple, weaktuple>* w = new ((hamt<weaktuple,weaktuple>*)GC_MALLOC(sizeof(hamt<weaktuple,weaktuple>))) hamt<weaktuple,weaktuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        h = h->insert(t,t);
+        const weaktuple* const u = new ((weaktuple*)GC_MALLOC(sizeof(weaktuple))) weaktuple(i,i+1,i*i);
+        w = w->insert(u,u);
+    }
+
+    const hamt_stats st = h->stats();
+    u64 pairs = st.collision_pairs;
+    u64 slots = 0;
+    for (u32 d = 0; d <= bd; ++d)
+        pairs += st.depth_pairs[d];
+    for (u32 i = 0; i < rootsize; ++i)
+        slots += st.root_pairs[i];
+    if (pairs != h->size() || slots != h->size() || st.collisions != 0)
+    {    std::cout << "stats miscounted pairs" << std::endl; exit(1); }
+
+    // A weak hash shows up as long collision nodes
+    const hamt_stats ws = w->stats();
+    if (ws.collisions == 0 || ws.collisions > 64 || ws.collision_pairs + 64 < loops || ws.longest_collision * 64 < loops)
+    {    std::cout << "stats missed collisions" << std::endl; exit(1); }
+
+    // A version one insert away shares all but one path with h
+    const tuple* const t = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(loops,loops+1,loops*loops);
+    const hamt<tuple, tuple>* const h2 = h->insert(t,t);
+    const u64 shared = hamt<tuple, tuple>::shared_bytes(h, h2);
+    if (hamt<tuple, tuple>::shared_bytes(h, h) != st.node_bytes
+        || shared >= st.node_bytes || shared + 64*bd*sizeof(tuple) < st.node_bytes - sizeof(hamt<tuple, tuple>))
+    {    std::cout << "shared_bytes measured the wrong sharing" << std::endl; exit(1); }
+}
+
+
+// Runs the main operations over a hamt with geometry G and checks them against the default geometry
+template <typename G>
+void testgeometry()
+{
+    const u32 loops = 20000;
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    const hamt<tuple, tuple, gc_alloc, G>* g = new ((hamt<tuple,tuple,gc_alloc,G>*)GC_MALLOC(sizeof(hamt<tuple,tuple,gc_alloc,G>))) hamt<tuple,tuple,gc_alloc,G>();
+    transient_hamt<tuple, tuple, gc_alloc, G>* const t = g->transient();
+    std::pair<const tuple*, const tuple*>* const pairs
+        = (std::pair<const tuple*, const tuple*>*)GC_MALLOC(loops*sizeof(std::pair<const tuple*, const tuple*>));
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        pairs[i] = std::make_pair(k,k);
+        h = h->insert(k,k);
+        g = g->insert(k,k);
+        t->insert(k,k);
+    }
+    for (u32 i = 0; i < loops; i += 3)
+    {
+        const tuple k(i,i+1,i*i);
+        h = h->remove(&k);
+        g = g->remove(&k);
+        t->remove(&k);
+    }
+    const hamt<tuple, tuple, gc_alloc, G>* const b = hamt<tuple, tuple, gc_alloc, G>::from_range(pairs, pairs+loops);
+
+    if (g->size() != h->size() || t->persistent()->size() != h->size() || b->size() != loops)
+    {    std::cout << "Geometry changed the size" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        if (g->get(&k) != h->get(&k) || t->get(&k) != h->get(&k) || b->get(&k) == 0)
+        {    std::cout << "Geometry changed a lookup" << std::endl; exit(1); }
+    }
+
+    u64 n = 0;
+    for (const auto& kv : *g)
+        if (h->get(kv.first) == kv.second) ++n;
+    if (n != h->size() || g->intersect(b)->size() != g->size() || b->difference(g)->size() != loops - g->size())
+    {    std::cout << "Geometry changed iteration or set operations" << std::endl; exit(1); }
+}
+
+
+void testfingerprints()
+{
+    typedef hamt<countedtuple, countedtuple, gc_alloc, hamt_fingerprints<> > map_t;
+    typedef hamt<weaktuple, weaktuple, gc_alloc, hamt_fingerprints<> > weak_t;
+    const u32 loops = 20000;
+    const map_t* h = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const weak_t* w = new ((weak_t*)GC_MALLOC(sizeof(weak_t))) weak_t();
+    const countedtuple** const misses = (const countedtuple**)GC_MALLOC(loops*sizeof(const countedtuple*));
+    const countedtuple** const out = (const countedtuple**)GC_MALLOC(loops*sizeof(const countedtuple*));
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const countedtuple* const k = new ((countedtuple*)GC_MALLOC(sizeof(countedtuple))) countedtuple(i,i+1,i*i);
+        misses[i] = new ((countedtuple*)GC_MALLOC(sizeof(countedtuple))) countedtuple(i+loops,i,0);
+        h = h->insert(k,k);
+        const weaktuple* const t = new ((weaktuple*)GC_MALLOC(sizeof(weaktuple))) weaktuple(i,i+1,i*i);
+        w = w->insert(t,t);
+    }
+
+    // Misses only compare keys on a full-hash match, and a hit compares exactly once
+    compares = 0;
+    for (u32 i = 0; i < loops; ++i)
+        if (h->get(misses[i]) != 0 || h->remove(misses[i]) != h)
+        {    std::cout << "Fingerprints found a missing key" << std::endl; exit(1); }
+    h->get_many(misses, loops, out);
+    for (u32 i = 0; i < loops; ++i)
+        if (out[i] != 0)
+        {    std::cout << "Fingerprints found a missing key in get_many" << std::endl; exit(1); }
+    if (compares > 10)
+    {    std::cout << "Fingerprints did not skip key comparisons" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const countedtuple k(i,i+1,i*i);
+        compares = 0;
+        if (h->get(&k) == 0 || compares != 1)
+        {    std::cout << "Fingerprints broke a lookup" << std::endl; exit(1); }
+    }
+
+    // Colliding keys share fingerprints, so they still fall back to comparing keys
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        const weaktuple k(i,i+1,i*i);
+        w = w->remove(&k);
+    }
+    if (w->size() != loops/2)
+    {    std::cout << "Fingerprints on colliding keys give the wrong size" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const weaktuple k(i,i+1,i*i);
+        const weaktuple* const v = w->get(&k);
+        if ((v != 0) != (i % 2 == 1) || (v && !(*v == k)))
+        {    std::cout << "Fingerprints on colliding keys kept the wrong tuple" << std::endl; exit(1); }
+    }
+    while (w->size() > 0)
+    {
+        const weaktuple* k = 0;
+        const weaktuple* v = 0;
+        w = w->removeFirst(&k, &v);
+        if (k != v || w->get(k) != 0)
+        {    std::cout << "removeFirst with fingerprints failed" << std::endl; exit(1); }
+    }
+
+    // Set operations bottom out in collision nodes, where they reuse the cached hashes
+    typedef hamt<hashedtuple, hashedtuple, gc_alloc, hamt_fingerprints<> > hashed_t;
+    const hashed_t* a = new ((hashed_t*)GC_MALLOC(sizeof(hashed_t))) hashed_t();
+    const hashed_t* b = a;
+    for (u32 i = 0; i < 3000; ++i)
+    {
+        const hashedtuple* const t = new ((hashedtuple*)GC_MALLOC(sizeof(hashedtuple))) hashedtuple(i,i+1,i*i);
+        if (i % 3 != 0)
+            a = a->insert(t,t);
+        if (i % 2 != 0)
+            b = b->insert(t,t);
+    }
+    hashes = 0;
+    const u64 u = a->union_with(b, [](const hashedtuple* k, const hashedtuple* x, const hashedtuple* y) { return y; })->size();
+    const u64 n = a->intersect(b)->size();
+    const u64 d = a->difference(b)->size();
+    if (u != 2500 || n != 1000 || d != 1000)
+    {    std::cout << "Set operations with fingerprints produced the wrong sizes" << std::endl; exit(1); }
+    if (hashes != 0)
+    {    std::cout << "Set operations with fingerprints hashed keys again" << std::endl; exit(1); }
+
+    // So does diff, where it looks the pairs of one side up in the other
+    u64 added = 0, removed = 0;
+    hashed_t::diff(a, b,
+                   [&added](const hashedtuple* k, const hashedtuple* v) { ++added; },
+                   [&removed](const hashedtuple* k, const hashedtuple* v) { ++removed; },
+                   [](const hashedtuple* k, const hashedtuple* va, const hashedtuple* vb) { });
+    if (added != 500 || removed != 1000 || hashes != 0)
+    {    std::cout << "diff with fingerprints hashed keys again" << std::endl; exit(1); }
+}
+
+
+void testprobes()
+{
+    const u32 loops = 20000;
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    transient_hamt<tuple, tuple>* const t = h->transient();
+    const hamt<weaktuple, weaktuple>* w = new ((hamt<weaktuple,weaktuple>*)GC_MALLOC(sizeof(hamt<weaktuple,weaktuple>))) hamt<weaktuple,weaktuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        h = i % 2 ? h->insert(k->hash(), k, k) : h->insert(k, k);
+        t->insert(k->hash(), k, k);
+        const weaktuple* const c = new ((weaktuple*)GC_MALLOC(sizeof(weaktuple))) weaktuple(i,i+1,i*i);
+        w = w->insert(c->hash(), c, c);
+    }
+
+    // Probes on the stack, by precomputed hash and of another type all find the same pairs
+    for (u32 i = 0; i < 2*loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        const weaktuple c(i,i+1,i*i);
+        const tuple* const v = h->get(&k);
+        if ((v != 0) != (i < loops) || h->get(k) != v || h->get(k.hash(), k) != v || h->find(tupleprobe(i)) != v
+            || t->get(k) != v || t->find(tupleprobe(i)) != v || (w->get(c) != 0) != (i < loops)
+            || w->get(c.hash(), c) != w->get(&c))
+        {    std::cout << "Probe lookups disagree" << std::endl; exit(1); }
+    }
+
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        const tuple k(i,i+1,i*i);
+        h = i % 4 ? h->remove(k) : h->remove(k.hash(), k);
+        t->remove(k);
+        const weaktuple c(i,i+1,i*i);
+        w = w->remove(c.hash(), c);
+    }
+    if (h->size() != loops/2 || t->size() != loops/2 || w->size() != loops/2)
+    {    std::cout << "Probe removes give the wrong size" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+        if ((h->find(tupleprobe(i)) != 0) != (i % 2 == 1) || (t->find(tupleprobe(i)) != 0) != (i % 2 == 1))
+        {    std::cout << "Probe removes removed the wrong keys" << std::endl; exit(1); }
+}
+
+
+void testsnapshot()
+{
+    const u32 loops = 20000;
+    const char* const path = "test_hamt.snapshot";
+    const hamt<tuple, tuple>* h = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    const hamt<weaktuple, tuple>* w = new ((hamt<weaktuple,tuple>*)GC_MALLOC(sizeof(hamt<weaktuple,tuple>))) hamt<weaktuple,tuple>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        const tuple* const v = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i*i,i,0);
+        h = h->insert(k,v);
+        const weaktuple* const c = new ((weaktuple*)GC_MALLOC(sizeof(weaktuple))) weaktuple(i,i+1,i*i);
+        w = w->insert(c,v);
+    }
+
+    // Every pair reads back from the mapping, including those in collision nodes
+    if (!h->save(path))
+    {    std::cout << "Saving a snapshot failed" << std::endl; exit(1); }
+    hamt_view<tuple, tuple>* const view = hamt_view<tuple, tuple>::open(path);
+    if (view == 0 || view->size() != loops || hamt_view<tuple, tuple, hamt_pod_codec<tuple>, hamt_pod_codec<tuple>,
+                                                                  hamt_pow2_geometry<5> >::open(path) != 0)
+    {    std::cout << "Opening a snapshot failed" << std::endl; exit(1); }
+    for (u32 i = 0; i < 2*loops; ++i)
+    {
+        const tuple k(i,i+1,i*i);
+        const tuple* const v = view->get(k);
+        if ((v != 0) != (i < loops) || (v && !(*v == *(h->get(k)))) || view->find(tupleprobe(i)) != v)
+        {    std::cout << "Snapshot lookup failed" << std::endl; exit(1); }
+    }
+    u64 n = 0;
+    view->for_each([&n, h](const tuple* k, const tuple* v) { if (*(h->get(*k)) == *v) ++n; });
+    if (n != loops)
+    {    std::cout << "Snapshot iteration failed" << std::endl; exit(1); }
+    delete view;
+
+    if (!w->save(path))
+    {    std::cout << "Saving a snapshot failed" << std::endl; exit(1); }
+    hamt_view<weaktuple, tuple>* const weak = hamt_view<weaktuple, tuple>::open(path);
+    for (u32 i = 0; i < 2*loops; ++i)
+    {
+        const weaktuple k(i,i+1,i*i);
+        const tuple* const v = weak->get(k);
+        if ((v != 0) != (i < loops) || (v && !(*v == *(w->get(k)))))
+        {    std::cout << "Snapshot lookup of colliding keys failed" << std::endl; exit(1); }
+    }
+    delete weak;
+    std::remove(path);
+}
+
+
+// Checks that diff reports exactly how b differs from a, against a full comparison
+template <typename T>
+void checkdiff(const hamt<T,T>* const a, const hamt<T,T>* const b)
+{
+    u64 added = 0, removed = 0, changed = 0;
+    bool wrong = false;
+    hamt<T,T>::diff(a, b,
+        [&](const T* k, const T* v) { wrong = wrong || a->get(k) || b->get(k) != v; ++added; },
+        [&](const T* k, const T* v) { wrong = wrong || b->get(k) || a->get(k) != v; ++removed; },
+        [&](const T* k, const T* va, const T* vb) { wrong = wrong || va == vb || a->get(k) != va || b->get(k) != vb; ++changed; });
+    if (wrong)
+    {    std::cout << "diff reported a difference that isn't there" << std::endl; exit(1); }
+
+    u64 inboth = 0, same = 0;
+    for (const auto& kv : *a)
+        if (const T* const v = b->get(kv.first))
+        {
+            ++inboth;
+            if (v == kv.second) ++same;
+        }
+    if (added != b->size() - inboth || removed != a->size() - inboth || changed != inboth - same)
+    {    std::cout << "diff missed a difference" << std::endl; exit(1); }
+}
+
+template <typename T>
+void testdiff()
+{
+    const u32 loops = 20000;
+    const hamt<T,T>* a = new ((hamt<T,T>*)GC_MALLOC(sizeof(hamt<T,T>))) hamt<T,T>();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const T* const k = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        a = a->insert(k,k);
+    }
+    checkdiff(a, a);
+
+    // Derive b by a few adds, removes and changes, some of them undone again
+    const hamt<T,T>* b = a;
+    for (u32 i = 0; i < 300; ++i)
+    {
+        const u32 x = std::rand() % (2*loops);
+        const T* const k = new ((T*)GC_MALLOC(sizeof(T))) T(x,x+1,x*x);
+        switch (std::rand() % 3)
+        {
+            case 0: b = b->insert(k, k); break;
+            case 1: b = b->remove(k); break;
+            default: b = b->insert(k, new ((T*)GC_MALLOC(sizeof(T))) T(x,0,0)); break;
+        }
+        checkdiff(a, b);
+        checkdiff(b, a);
+    }
+}
+
+
+// The content hash kept across edits must match one recomputed from scratch
+template <typename M>
+bool samecontent(const M* const m)
+{
+    const hamt<tuple, tuple>* plain = new ((hamt<tuple,tuple>*)GC_MALLOC(sizeof(hamt<tuple,tuple>))) hamt<tuple,tuple>();
+    for (const auto& kv : *m)
+        plain = plain->insert(kv.first, kv.second);
+    return plain->hash() == m->hash();
+}
+
+void testcontent()
+{
+    typedef hamt<tuple, tuple, gc_alloc, hamt_content_hashes<> > map_t;
+    const u32 loops = 5000;
+    const map_t* const empty = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const map_t* up = empty;
+    const map_t* down = empty;
+    transient_hamt<tuple, tuple, gc_alloc, hamt_content_hashes<> >* const t = empty->transient();
+    std::pair<const tuple*, const tuple*>* const pairs
+        = (std::pair<const tuple*, const tuple*>*)GC_MALLOC(loops*sizeof(std::pair<const tuple*, const tuple*>));
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        const tuple* const j = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(loops-1-i,loops-i,(loops-1-i)*(loops-1-i));
+        pairs[i] = std::make_pair(k,k);
+        up = up->insert(k,k);
+        down = down->insert(j,j);
+        t->insert(j,j);
+    }
+
+    // Equal contents give equal hashes however they were built
+    const map_t* const built = map_t::from_range(pairs, pairs+loops);
+    if (up->hash() != down->hash() || up->hash() != t->persistent()->hash() || up->hash() != built->hash()
+        || !samecontent(up) || !(*up == *down) || !(*up == *built) || *up != *t->persistent())
+    {    std::cout << "Equal maps hash or compare differently" << std::endl; exit(1); }
+
+    // Every kind of edit keeps the hash up to date
+    const map_t* m = up;
+    for (u32 i = 0; i < 200; ++i)
+    {
+        const map_t* const prev = m;
+        const u32 x = std::rand() % (2*loops);
+        const tuple* const k = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(x,x+1,x*x);
+        switch (std::rand() % 5)
+        {
+            case 0: m = m->insert(k, k); break;
+            case 1: m = m->remove(k); break;
+            case 2: m = m->insert(k, new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(x,0,0)); break;
+            case 3: { const tuple* a; const tuple* b; m = m->removeFirst(&a, &b); break; }
+            default: m = i % 2 ? m->intersect(down->remove(k)) : m->union_with(down->remove(k), [](const tuple* k, const tuple* a, const tuple* b) { return b; });
+        }
+        bool same = true;
+        map_t::diff(prev, m, [&same](const tuple* k, const tuple* v) { same = false; },
+                    [&same](const tuple* k, const tuple* v) { same = false; },
+                    [&same](const tuple* k, const tuple* a, const tuple* b) { same = same && *a == *b; });
+        if (!samecontent(m) || (*m == *prev) != same || (same && m->hash() != prev->hash()))
+        {    std::cout << "Content hash went stale after an edit" << std::endl; exit(1); }
+    }
+
+    // Maps work as keys of other maps, found by content rather than identity
+    hamt<map_t, tuple>* sets = new ((hamt<map_t,tuple>*)GC_MALLOC(sizeof(hamt<map_t,tuple>))) hamt<map_t,tuple>();
+    const hamt<map_t, tuple>* s = sets->insert(up, pairs[0].first)->insert(m, pairs[1].first);
+    if (s->get(*down) != pairs[0].first || s->get(*built) != pairs[0].first || s->get(*empty) != 0 || s->size() != (*m == *up ? 1 : 2))
+    {    std::cout << "Maps as keys failed" << std::endl; exit(1); }
+}
+
+
+// update and insert_if_absent in place of get then insert; writes that change nothing return the same version
+template <typename T>
+void testupdate()
+{
+    typedef hamt<T, T> map_t;
+    typedef hamt<T, T, gc_alloc, hamt_content_hashes<> > cmap_t;
+    const u32 loops = 3000;
+    const T** const keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    for (u32 i = 0; i < loops; ++i)
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+    auto count = [](const T* const old) { return new ((T*)GC_MALLOC(sizeof(T))) T(old ? old->x+1 : 1, 0, 0); };
+    auto keep = [](const T* const old) { return old; };
+    auto drop = [](const T* const old) { return (const T*)0; };
+
+    const map_t* m = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const cmap_t* c = new ((cmap_t*)GC_MALLOC(sizeof(cmap_t))) cmap_t();
+    for (u32 j = 0; j < 3*loops; ++j)
+    {
+        m = m->update(keys[j % loops], count);
+        c = c->update(keys[j % loops], count);
+    }
+    if (m->size() != loops || c->size() != loops || c->hash() != m->hash())
+    {    std::cout << "update miscounted" << std::endl; exit(1); }
+
+    const T* const absent = new ((T*)GC_MALLOC(sizeof(T))) T(loops,loops+1,loops*loops);
+    for (u32 i = 0; i < loops; ++i)
+        if (m->get(keys[i])->x != 3 || m->insert(keys[i], m->get(keys[i])) != m || m->insert_if_absent(keys[i], keys[i]) != m
+            || m->update(keys[i], keep) != m || c->update(keys[i], keep) != c)
+        {    std::cout << "A write that changed nothing made a new version" << std::endl; exit(1); }
+    if (m->remove(absent) != m || m->update(absent, keep) != m || m->update(absent, drop) != m)
+    {    std::cout << "A write of an absent key that changed nothing made a new version" << std::endl; exit(1); }
+
+    const map_t* const added = m->insert_if_absent(absent, absent);
+    if (added->size() != loops+1 || added->get(absent) != absent || m->get(absent) != 0)
+    {    std::cout << "insert_if_absent failed to insert" << std::endl; exit(1); }
+
+    // f returning 0 removes the key
+    const map_t* r = m;
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        r = r->update(keys[i], drop);
+        c = c->update(keys[i], drop);
+    }
+    for (u32 i = 0; i < loops; ++i)
+        if ((r->get(keys[i]) == 0) != (i % 2 == 0))
+        {    std::cout << "update failed to remove" << std::endl; exit(1); }
+    if (r->size() != loops/2 || c->size() != loops/2 || c->hash() != r->hash())
+    {    std::cout << "update miscounted removals" << std::endl; exit(1); }
+}
+
+
+// However keys are removed, the trie is left just as if the remaining keys had only been inserted
+void testcanonical()
+{
+    typedef hamt<tuple, tuple> map_t;
+    const u32 loops = 20000;
+    const map_t* const empty = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const tuple** const keys = (const tuple**)GC_MALLOC(loops*sizeof(const tuple*));
+    const map_t* full = empty;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        keys[i] = new ((tuple*)GC_MALLOC(sizeof(tuple))) tuple(i,i+1,i*i);
+        full = full->insert(keys[i], keys[i]);
+    }
+
+    // Keep every tenth key
+    const map_t* fresh = empty;
+    const map_t* dropped = empty;
+    const map_t* removed = full;
+    transient_hamt<tuple, tuple>* const t = full->transient();
+    for (u32 i = 0; i < loops; ++i)
+        if (i % 10 == 0)
+            fresh = fresh->insert(keys[i], keys[i]);
+        else
+        {
+            dropped = dropped->insert(keys[i], keys[i]);
+            removed = removed->remove(keys[i]);
+            t->remove(keys[i]);
+        }
+    const map_t* const diffed = full->difference(dropped);
+
+    const hamt_stats st = fresh->stats();
+    const map_t* const versions[] = { removed, t->persistent(), diffed };
+    for (const map_t* const v : versions)
+    {
+        const hamt_stats vs = v->stats();
+        if (std::memcmp(&st, &vs, sizeof(hamt_stats)) != 0 || v->intern() != fresh->intern())
+        {    std::cout << "Removals left a non-canonical trie" << std::endl; exit(1); }
+    }
+
+    // removeFirst down to nothing leaves an empty map like any other
+    const map_t* m = fresh;
+    for (u32 i = 0; i < loops/10; ++i)
+    {
+        const tuple* k;
+        const tuple* v;
+        m = m->removeFirst(&k, &v);
+    }
+    if (m->size() != 0 || m->stats().node_bytes != sizeof(map_t) || m->intern() != empty->intern())
+    {    std::cout << "removeFirst left a non-canonical trie" << std::endl; exit(1); }
+}
+
+
+// A compacted version holds the same pairs in one block and grows like any other
+template <typename T>
+void testcompact()
+{
+    typedef hamt<T, T> map_t;
+    const u32 loops = 20000;
+    const T** const keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    const map_t* h = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        h = h->insert(keys[i], keys[i]);
+    }
+    for (u32 i = 0; i < loops; i += 3)
+        h = h->remove(keys[i]);
+
+    const map_t* const c = h->compact();
+    const map_t* const p = h->compact(true);
+    const hamt_stats hs = h->stats();
+    const hamt_stats cs = c->stats();
+    const u8* const lo = (const u8*)p;
+    const u8* const hi = lo + hs.node_bytes + p->size()*2*sizeof(T);
+    if (c->size() != h->size() || p->size() != h->size() || std::memcmp(&hs, &cs, sizeof(hamt_stats)) != 0
+        || map_t::shared_bytes(h, c) != 0 || c->intern() != h->intern())
+    {    std::cout << "compact changed the map" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const T* const v = p->get(*keys[i]);
+        if (c->get(keys[i]) != h->get(keys[i]) || (v == 0) != (i % 3 == 0) || (v && (!(*v == *keys[i]) || (const u8*)v < lo || (const u8*)v >= hi)))
+        {    std::cout << "compact lost or misplaced a pair" << std::endl; exit(1); }
+    }
+
+    // Updates path copy out of the block as usual
+    const map_t* g = c;
+    for (u32 i = 0; i < loops; ++i)
+        g = i % 2 ? g->insert(keys[i], keys[i]) : g->remove(keys[i]);
+    for (u32 i = 0; i < loops; ++i)
+        if ((g->get(keys[i]) != 0) != (i % 2 == 1) || c->get(keys[i]) != h->get(keys[i]))
+        {    std::cout << "A compacted map updated wrongly" << std::endl; exit(1); }
+}
+
+
+// Building in parallel gives exactly the map inserting the same pairs in order gives
+template <typename T>
+void testparallelinsert(const u32 loops)
+{
+    typedef hamt<T, T> map_t;
+    typedef std::pair<const T*, const T*> pair_t;
+    const map_t* const empty = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const map_t* base = empty;
+    for (u32 i = 0; i < loops; i += 2)
+    {
+        const T* const k = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        base = base->insert(k, k);
+    }
+
+    // Every fifth key appears twice, and half the keys are already in base; the last pair must win
+    pair_t* const pairs = (pair_t*)GC_MALLOC((loops + loops/5)*sizeof(pair_t));
+    u32 n = 0;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        const T* const k = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        pairs[n++] = std::make_pair(k, k);
+        if (i % 5 == 0)
+            pairs[n++] = std::make_pair(k, new ((T*)GC_MALLOC(sizeof(T))) T(i,i+2,i));
+    }
+
+    const map_t* const bases[] = { empty, base };
+    for (u32 j = 0; j < 2; ++j)
+    {
+        const map_t* seq = bases[j];
+        for (u32 i = 0; i < n; ++i)
+            seq = seq->insert(pairs[i].first, pairs[i].second);
+        const map_t* const par = bases[j]->parallel_insert_all(pairs, pairs+n, 4, 64);
+        const hamt_stats ss = seq->stats();
+        const hamt_stats ps = par->stats();
+        if (par->size() != seq->size() || std::memcmp(&ss, &ps, sizeof(hamt_stats)) != 0 || par->intern() != seq->intern())
+        {    std::cout << "parallel_insert_all built a different map" << std::endl; exit(1); }
+    }
+    if (base->parallel_insert_all(pairs, pairs, 4, 64) != base
+        || base->parallel_insert_all(pairs, pairs+n, 1)->intern() != base->parallel_insert_all(pairs, pairs+n, 4, 64)->intern())
+    {    std::cout << "parallel_insert_all depends on its workers" << std::endl; exit(1); }
+}
+
+
+// Tracks the nodes an rc_hamt holds, to check they're all freed
+struct counting_alloc
+{
+    static u64 live;
+    static u64 allocations;
+
+    static void* allocate(const u64 n)
+    {
+        live += n;
+        ++allocations;
+        return malloc_alloc::allocate(n);
+    }
+
+    static void deallocate(void* const p, const u64 n)
+    {
+        live -= n;
+        malloc_alloc::deallocate(p, n);
+    }
+};
+u64 counting_alloc::live = 0;
+u64 counting_alloc::allocations = 0;
+
+// rc_hamt against hamt: copies evolve independently, unshared nodes are updated in place,
+// and every node is freed once the last map referring to it is gone
+template <typename T>
+void testrc()
+{
+    typedef rc_hamt<T, T, counting_alloc> rc_t;
+    const u32 loops = 20000;
+    const T** const keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    for (u32 i = 0; i < loops; ++i)
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+    {
+        // A map that is never copied allocates a few times per node it ends up with (as nodes
+        // grow), rather than once per node on every update's path
+        rc_t a;
+        const hamt<T, T>* h = new ((hamt<T,T>*)GC_MALLOC(sizeof(hamt<T,T>))) hamt<T,T>();
+        for (u32 i = 0; i < loops; ++i)
+        {
+            a.insert(keys[i], keys[i]);
+            h = h->insert(keys[i], keys[i]);
+        }
+        const hamt_stats st = h->stats();
+        u64 nodes = 1 + st.collisions;
+        for (u32 i = 0; i < 64; ++i)
+            nodes += st.node_popcounts[i];
+        if (a.size() != loops || counting_alloc::allocations > 2*nodes + 16*st.collisions)
+        {    std::cout << "rc_hamt copied nodes it owned alone" << std::endl; exit(1); }
+
+        // b shares a's trie until either changes
+        rc_t b = a;
+        const hamt<T, T>* g = h;
+        for (u32 j = 0; j < 2*loops; ++j)
+        {
+            const u32 i = std::rand() % loops;
+            const T* const v = keys[std::rand() % loops];
+            if (j % 3 == 0)
+            {
+                b.remove(keys[i]);
+                g = g->remove(keys[i]);
+            }
+            else
+            {
+                b.insert(keys[i], v);
+                g = g->insert(keys[i], v);
+            }
+        }
+        rc_t c = b;
+        c.remove(*keys[0]);
+        if (a.size() != loops || b.size() != g->size() || c.get(keys[0]) != 0 || c.size() != b.size() - (b.get(keys[0]) != 0))
+        {    std::cout << "rc_hamt copies interfered" << std::endl; exit(1); }
+        for (u32 i = 0; i < loops; ++i)
+            if (a.get(keys[i]) != keys[i] || b.get(*keys[i]) != g->get(keys[i]))
+            {    std::cout << "rc_hamt lost or changed a pair" << std::endl; exit(1); }
+        u64 n = 0;
+        b.for_each([&n, g](const T* const k, const T* const v) { n += g->get(k) == v; });
+        if (n != g->size())
+        {    std::cout << "rc_hamt for_each disagreed" << std::endl; exit(1); }
+
+        // Removing everything leaves an empty root
+        for (u32 i = 0; i < loops; ++i)
+            a.remove(keys[i]);
+        if (a.size() != 0 || b.size() != g->size())
+        {    std::cout << "rc_hamt failed to empty" << std::endl; exit(1); }
+    }
+    if (counting_alloc::live != 0)
+    {    std::cout << "rc_hamt leaked nodes" << std::endl; exit(1); }
+    counting_alloc::allocations = 0;
+}
+
+
+// Interned versions with the same pairs are one root, whatever order they were built in
+template <typename T>
+void testintern(const bool reorder)
+{
+    typedef hamt<T, T> map_t;
+    const u32 loops = 5000;
+    const map_t* const empty = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    const T** const keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    const map_t* a = empty;
+    for (u32 i = 0; i < loops; ++i)
+    {
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        a = a->insert(keys[i], keys[i]);
+    }
+    const map_t* b = empty;
+    for (u32 i = 0; i < loops; ++i)
+        b = b->insert(keys[reorder ? loops-1-i : i], keys[reorder ? loops-1-i : i]);
+
+    const map_t* const ai = a->intern();
+    const map_t* const bi = b->intern();
+    if (ai != bi || ai->intern() != ai || a->intern() != ai || ai->size() != loops)
+    {    std::cout << "Equal maps interned to different roots" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+        if (ai->get(keys[i]) != keys[i])
+        {    std::cout << "Interned map lost a key" << std::endl; exit(1); }
+
+    // A version one insert away from an interned one shares all but a path with it once interned
+    const T* const t = new ((T*)GC_MALLOC(sizeof(T))) T(loops,loops+1,loops*loops);
+    const map_t* const ci = b->insert(t,t)->intern();
+    const u64 bytes = ai->stats().node_bytes;
+    if (ci == ai || ci->get(t) != t || map_t::shared_bytes(ai, ci) + 64*bd*sizeof(T) < bytes - sizeof(map_t)
+        || ci->remove(t)->intern() != ai)
+    {    std::cout << "Interning shared the wrong nodes" << std::endl; exit(1); }
+}
+
+
+// A hamt_set holds the same keys as a hamt used as a set, and subset checks agree with get
+template <typename T>
+void testset(const u32 loops)
+{
+    typedef hamt_set<T> set_t;
+    typedef hamt<T, T> map_t;
+    const T** const keys = (const T**)GC_MALLOC(loops*sizeof(const T*));
+    const set_t* const empty = new ((set_t*)GC_MALLOC(sizeof(set_t))) set_t();
+    const set_t* s = empty;
+    const map_t* h = new ((map_t*)GC_MALLOC(sizeof(map_t))) map_t();
+    for (u32 i = 0; i < loops; ++i)
+    {
+        keys[i] = new ((T*)GC_MALLOC(sizeof(T))) T(i,i+1,i*i);
+        s = s->add(keys[i]);
+        h = h->insert(keys[i], keys[i]);
+    }
+    if (s->size() != h->size() || s->add(keys[loops/2]) != s)
+    {    std::cout << "hamt_set added the wrong keys" << std::endl; exit(1); }
+    u64 seen = 0;
+    s->for_each([&seen, h](const T* const k) { seen += h->get(k) == k; });
+    if (seen != loops)
+    {    std::cout << "hamt_set::for_each missed or repeated keys" << std::endl; exit(1); }
+
+    // Erase every third key, and check contains against the map
+    const set_t* e = s;
+    for (u32 i = 0; i < loops; i += 3)
+    {
+        e = e->erase(*keys[i]);
+        h = h->remove(keys[i]);
+    }
+    const T miss(loops, loops, loops);
+    if (e->size() != h->size() || e->contains(miss) || e->erase(miss) != e)
+    {    std::cout << "hamt_set erased the wrong keys" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+        if (e->contains(keys[i]) != (h->get(keys[i]) != 0) || !s->contains(*keys[i]))
+        {    std::cout << "hamt_set::contains disagrees with hamt::get" << std::endl; exit(1); }
+
+    // Erasing keeps the trie canonical, so a set rebuilt from the remaining keys is equal
+    const set_t* r = empty;
+    for (u32 i = loops; i-- > 0; )
+        if (i % 3)
+            r = r->add(keys[i]);
+    const set_t* const t = e->add(keys[0]);
+    if (!e->subset_of(s) || s->subset_of(e) || !e->subset_of(e) || !empty->subset_of(e) || e->subset_of(empty)
+        || *r != *e || *t == *e || !e->subset_of(t) || t->subset_of(e) || !t->subset_of(s))
+    {    std::cout << "hamt_set subset checks are wrong" << std::endl; exit(1); }
+    for (u32 i = 0; i < loops; ++i)
+        e = e->erase(keys[i]);
+    if (e->size() != 0 || *e != *empty)
+    {    std::cout << "hamt_set did not empty" << std::endl; exit(1); }
+}
+
+
 int main()
 {
     u32 rounds = 4;
 
     std::srand(12345);//utime());
 
+    testtransient();
+    testfromrange();
+    testsetops();
+    {
+        hamt_arena arena;
+        hamt_arena::scope scope(arena);
+        testalloc<arena_alloc>();
+    }
+    testalloc<pool_alloc>();
+    hamt_pool::local().release();
+    testinline();
+    testgetmany();
+    testcollisions();
+    testatomic();
+    testparallel();
+    teststats();
+    testgeometry<hamt_pow2_geometry<4> >();
+    testgeometry<hamt_pow2_geometry<5> >();
+    testgeometry<hamt_fingerprints<> >();
+    testgeometry<hamt_fingerprints<hamt_pow2_geometry<5> > >();
+    testfingerprints();
+    testprobes();
+    testsnapshot();
+    testdiff<tuple>();
+    testdiff<weaktuple>();
+    testcontent();
+    testintern<tuple>(true);
+    testintern<weaktuple>(false);
+    testupdate<tuple>();
+    testupdate<weaktuple>();
+    testcanonical();
+    testcompact<tuple>();
+    testcompact<weaktuple>();
+    testrc<tuple>();
+    testrc<weaktuple>();
+    testparallelinsert<tuple>(30000);
+    testparallelinsert<weaktuple>(3000);
+    testset<tuple>(50000);
+    testset<weaktuple>(3000);
+
     u64 best = 0xffffffffffffffff;
     u64 sum = 0;
     for (u32 i = 0; i < rounds; ++i)